@@ -1,16 +1,74 @@
+#ifndef _WIN32
+#	define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <assert.h>
 
+#include "../Public/PokeQuery.h"
+
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	define NOMINMAX
+#	include <WinSock2.h>
+#	include <afunix.h>
+#	include <Windows.h>
+#	include <io.h>
+#	include <fcntl.h>
+#	ifdef _MSC_VER
+#		pragma comment(lib, "ws2_32.lib")
+#	endif
+#else
+#	include <pthread.h>
+#	include <unistd.h>
+#	include <fcntl.h>
+#	include <glob.h>
+#	include <signal.h>
+#	include <errno.h>
+#	include <time.h>
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <sys/socket.h>
+#	include <sys/un.h>
+#endif
+
 #ifdef _MSC_VER
 #	define MSVC_WARNINGS(...) __pragma(warning(__VA_ARGS__))
 #else
 #	define MSVC_WARNINGS(...)
 #endif
 
+// The library leaves out the command line and the server, and with them
+// the only callers of many parsing and threading helpers.
+#ifdef POKEQUERY_LIBRARY
+#	ifdef _MSC_VER
+#		pragma warning(disable: 4505)
+#	else
+#		pragma GCC diagnostic ignored "-Wunused-function"
+#	endif
+#endif
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#	define SIMD_X86 1
+#	include <immintrin.h>
+#	ifdef _MSC_VER
+#		include <intrin.h>
+#		define TARGET_SSE2
+#		define TARGET_AVX2
+#	else
+#		define TARGET_SSE2 __attribute__((target("sse2")))
+#		define TARGET_AVX2 __attribute__((target("avx2")))
+#	endif
+#else
+#	define SIMD_X86 0
+#endif
+
 typedef uint8_t byte;
 
 #define PP_STR_I(...) #__VA_ARGS__
@@ -102,6 +160,441 @@ StringSpan_FindAnyChar(struct StringSpan text, struct StringSpan chars)
 	return (size_t)-1;
 }
 
+static char*
+String_Duplicate(const char* string, size_t length)
+{
+	char* copy = (char*)malloc(length + 1);
+	if (copy == NULL)
+		return NULL;
+	memcpy(copy, string, length);
+	copy[length] = 0;
+	return copy;
+}
+
+struct Buffer
+{
+	char* data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+Buffer_Init(struct Buffer* buffer)
+{
+	buffer->data = NULL;
+	buffer->size = 0;
+	buffer->capacity = 0;
+}
+
+static void
+Buffer_Destroy(struct Buffer* buffer)
+{
+	free(buffer->data);
+	Buffer_Init(buffer);
+}
+
+static bool
+Buffer_Reserve(struct Buffer* buffer, size_t size)
+{
+	if (size <= buffer->capacity)
+		return true;
+
+	size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+	while (capacity < size)
+		capacity *= 2;
+
+	char* data = (char*)realloc(buffer->data, capacity);
+	if (data == NULL)
+		return false;
+
+	buffer->data = data;
+	buffer->capacity = capacity;
+	return true;
+}
+
+static bool
+Buffer_Append(struct Buffer* buffer, const char* data, size_t size)
+{
+	if (!Buffer_Reserve(buffer, buffer->size + size))
+		return false;
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+	return true;
+}
+
+static bool
+Buffer_Printf(struct Buffer* buffer, const char* format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	int length = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+
+	if (length < 0 || !Buffer_Reserve(buffer, buffer->size + length + 1))
+		return false;
+
+	va_start(args, format);
+	vsnprintf(buffer->data + buffer->size, length + 1, format, args);
+	va_end(args);
+
+	buffer->size += length;
+	return true;
+}
+
+static bool
+Buffer_AppendChar(struct Buffer* buffer, char ch)
+{
+	if (!Buffer_Reserve(buffer, buffer->size + 1))
+		return false;
+	buffer->data[buffer->size++] = ch;
+	return true;
+}
+
+static bool
+Buffer_AppendString(struct Buffer* buffer, const char* string)
+{
+	return Buffer_Append(buffer, string, strlen(string));
+}
+
+// Appends string left-aligned in a field of at least width characters.
+static bool
+Buffer_AppendPadded(struct Buffer* buffer, const char* string, size_t width)
+{
+	size_t length = strlen(string);
+	size_t padding = length < width ? width - length : 0;
+
+	if (!Buffer_Reserve(buffer, buffer->size + length + padding))
+		return false;
+
+	memcpy(buffer->data + buffer->size, string, length);
+	memset(buffer->data + buffer->size + length, ' ', padding);
+	buffer->size += length + padding;
+	return true;
+}
+
+// Appends value in decimal, zero padded to at least width digits.
+static bool
+Buffer_AppendUInt(struct Buffer* buffer, uint64_t value, size_t width)
+{
+	char digits[20];
+	size_t count = 0;
+
+	do {
+		digits[count++] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+
+	size_t padding = count < width ? width - count : 0;
+
+	if (!Buffer_Reserve(buffer, buffer->size + count + padding))
+		return false;
+
+	char* data = buffer->data + buffer->size;
+	memset(data, '0', padding);
+	data += padding;
+
+	while (count != 0)
+		*data++ = digits[--count];
+
+	buffer->size = data - buffer->data;
+	return true;
+}
+
+// Appends the rest of the stream.
+static bool
+Buffer_ReadStream(struct Buffer* buffer, FILE* stream)
+{
+	while (true)
+	{
+		if (!Buffer_Reserve(buffer, buffer->size + 4096))
+			return false;
+
+		size_t count = fread(buffer->data + buffer->size, 1, buffer->capacity - buffer->size, stream);
+		buffer->size += count;
+
+		if (count == 0)
+			return !ferror(stream);
+	}
+}
+
+static bool
+Buffer_AppendUInt32LE(struct Buffer* buffer, uint32_t value)
+{
+	char data[4] = { (char)value, (char)(value >> 8), (char)(value >> 16), (char)(value >> 24) };
+	return Buffer_Append(buffer, data, sizeof(data));
+}
+
+static bool
+Buffer_AppendUInt64LE(struct Buffer* buffer, uint64_t value)
+{
+	return Buffer_AppendUInt32LE(buffer, (uint32_t)value) && Buffer_AppendUInt32LE(buffer, (uint32_t)(value >> 32));
+}
+
+typedef void FnThread(void* context);
+
+struct ThreadStart
+{
+	FnThread* func;
+	void* context;
+};
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef SRWLOCK Mutex;
+typedef CONDITION_VARIABLE Condition;
+typedef SRWLOCK RwLock;
+
+static DWORD WINAPI
+Thread_Main(LPVOID param)
+{
+	struct ThreadStart start = *(struct ThreadStart*)param;
+	free(param);
+	start.func(start.context);
+	return 0;
+}
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condition;
+typedef pthread_rwlock_t RwLock;
+
+static void*
+Thread_Main(void* param)
+{
+	struct ThreadStart start = *(struct ThreadStart*)param;
+	free(param);
+	start.func(start.context);
+	return NULL;
+}
+#endif
+
+static bool
+Thread_Create(Thread* thread, FnThread* func, void* context)
+{
+	struct ThreadStart* start = (struct ThreadStart*)malloc(sizeof(struct ThreadStart));
+	if (start == NULL)
+		return false;
+
+	start->func = func;
+	start->context = context;
+
+#ifdef _WIN32
+	*thread = CreateThread(NULL, 0, Thread_Main, start, 0, NULL);
+	if (*thread != NULL)
+		return true;
+#else
+	if (pthread_create(thread, NULL, Thread_Main, start) == 0)
+		return true;
+#endif
+
+	free(start);
+	return false;
+}
+
+static void
+Thread_Join(Thread thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
+
+static void
+Thread_Detach(Thread thread)
+{
+#ifdef _WIN32
+	CloseHandle(thread);
+#else
+	pthread_detach(thread);
+#endif
+}
+
+static size_t
+Thread_GetHardwareConcurrency(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (size_t)count : 1;
+#endif
+}
+
+// Distinguishes the calling thread from all other running threads, in
+// this process and in others.
+static uint64_t
+Thread_GetUniqueId(void)
+{
+#ifdef _WIN32
+	return (uint64_t)GetCurrentProcessId() << 32 | GetCurrentThreadId();
+#else
+	pthread_t self = pthread_self();
+	uint32_t thread = 0;
+	memcpy(&thread, &self, sizeof(self) < sizeof(thread) ? sizeof(self) : sizeof(thread));
+	return (uint64_t)getpid() << 32 | thread;
+#endif
+}
+
+static void
+Thread_Sleep(uint32_t milliseconds)
+{
+#ifdef _WIN32
+	Sleep(milliseconds);
+#else
+	struct timespec time;
+	time.tv_sec = milliseconds / 1000;
+	time.tv_nsec = (long)(milliseconds % 1000) * 1000000;
+	nanosleep(&time, NULL);
+#endif
+}
+
+static void
+Mutex_Init(Mutex* mutex)
+{
+#ifdef _WIN32
+	InitializeSRWLock(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+static void
+Mutex_Destroy(Mutex* mutex)
+{
+#ifdef _WIN32
+	UNUSED(mutex);
+#else
+	pthread_mutex_destroy(mutex);
+#endif
+}
+
+static void
+Mutex_Lock(Mutex* mutex)
+{
+#ifdef _WIN32
+	AcquireSRWLockExclusive(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
+}
+
+static void
+Mutex_Unlock(Mutex* mutex)
+{
+#ifdef _WIN32
+	ReleaseSRWLockExclusive(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+static void
+Condition_Init(Condition* condition)
+{
+#ifdef _WIN32
+	InitializeConditionVariable(condition);
+#else
+	pthread_cond_init(condition, NULL);
+#endif
+}
+
+static void
+Condition_Destroy(Condition* condition)
+{
+#ifdef _WIN32
+	UNUSED(condition);
+#else
+	pthread_cond_destroy(condition);
+#endif
+}
+
+// Mutex must be locked. It is released while waiting.
+static void
+Condition_Wait(Condition* condition, Mutex* mutex)
+{
+#ifdef _WIN32
+	SleepConditionVariableSRW(condition, mutex, INFINITE, 0);
+#else
+	pthread_cond_wait(condition, mutex);
+#endif
+}
+
+static void
+Condition_Broadcast(Condition* condition)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(condition);
+#else
+	pthread_cond_broadcast(condition);
+#endif
+}
+
+static void
+RwLock_Init(RwLock* lock)
+{
+#ifdef _WIN32
+	InitializeSRWLock(lock);
+#else
+	pthread_rwlock_init(lock, NULL);
+#endif
+}
+
+static void
+RwLock_Destroy(RwLock* lock)
+{
+#ifdef _WIN32
+	UNUSED(lock);
+#else
+	pthread_rwlock_destroy(lock);
+#endif
+}
+
+static void
+RwLock_LockShared(RwLock* lock)
+{
+#ifdef _WIN32
+	AcquireSRWLockShared(lock);
+#else
+	pthread_rwlock_rdlock(lock);
+#endif
+}
+
+static void
+RwLock_UnlockShared(RwLock* lock)
+{
+#ifdef _WIN32
+	ReleaseSRWLockShared(lock);
+#else
+	pthread_rwlock_unlock(lock);
+#endif
+}
+
+static void
+RwLock_Lock(RwLock* lock)
+{
+#ifdef _WIN32
+	AcquireSRWLockExclusive(lock);
+#else
+	pthread_rwlock_wrlock(lock);
+#endif
+}
+
+static void
+RwLock_Unlock(RwLock* lock)
+{
+#ifdef _WIN32
+	ReleaseSRWLockExclusive(lock);
+#else
+	pthread_rwlock_unlock(lock);
+#endif
+}
+
 MSVC_WARNINGS(push)
 MSVC_WARNINGS(disable: 4245)
 static const uint8_t GDigits[256] = {
@@ -130,11 +623,17 @@ ParseUInt32(struct StringSpan text, uint32_t radix, uint32_t max, uint32_t* out)
 	const char* data = text.data;
 	const char* last = data + text.size;
 
+	if (data == last)
+		return false;
+
 	while (data != last && *data == '0')
 		++data;
 
 	if (data == last)
-		return false;
+	{
+		*out = 0;
+		return true;
+	}
 
 	uint32_t accumulate = 0;
 
@@ -144,9 +643,10 @@ ParseUInt32(struct StringSpan text, uint32_t radix, uint32_t max, uint32_t* out)
 	uint32_t radixCheck = max / radix;
 
 	do {
-		uint8_t digit = GDigits[*data];
+		// Non-digits map to 0xFF, past any radix.
+		uint8_t digit = GDigits[(byte)*data];
 
-		if (digit == -1)
+		if (digit >= radix)
 			return false;
 
 		if (accumulate > radixCheck)
@@ -193,6 +693,12 @@ enum { SECTIONS(X_ENTRY) };
 enum { SECTIONS(X_ENTRY) };
 #undef X_ENTRY
 
+enum
+{
+	SECTION_MASK_ALL = (1 << SECTION_COUNT) - 1,
+	SECTION_MASK_STORAGE = SECTION_MASK_ALL & ~((1 << SECTION_STORAGE1) - 1),
+};
+
 #define SECTION_INDEX(name) (SECTION_##name)
 #define SECTION_SIZE(name) (SECTION_##name##_SIZE)
 
@@ -235,38 +741,192 @@ Section_CalculateChecksum(const struct Section* section)
 	return (checksum & 0xFFFF) + (checksum >> 16);
 }
 
-struct Save
+enum
 {
-	struct Section sections[SECTION_COUNT];
+	CPU_SSE2 = 1 << 0,
+	CPU_AVX2 = 1 << 1,
 };
 
-static bool
-Save_GetIndex(const struct Save* save, uint32_t* out)
+static uint32_t
+Cpu_GetFeatures(void)
 {
-	uint32_t index = save->sections[0].saveIndex;
-	for (size_t i = 1; i < SECTION_COUNT; ++i)
-		if (save->sections[i].saveIndex != index)
-			return false;
-	*out = index;
-	return true;
-}
+	uint32_t features = 0;
 
+#if SIMD_X86 && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int max = info[0];
+
+	__cpuid(info, 1);
+	if (info[3] & (1 << 26))
+		features |= CPU_SSE2;
+
+	bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+
+	if (avx && max >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5))
+			features |= CPU_AVX2;
+	}
+#elif SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		features |= CPU_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		features |= CPU_AVX2;
+#endif
+
+	return features;
+}
+
+struct Pokemon;
+
+typedef void FnSectionBatch_Checksum(const struct Section* sections, size_t count, uint16_t* checksums);
+typedef void FnPokemonBatch_Decrypt(struct Pokemon* pokemon, size_t count, uint16_t* checksums);
+typedef void FnPokemonBatch_Encrypt(struct Pokemon* pokemon, size_t count);
+typedef void FnColumn_Select(const uint16_t* column, size_t count, uint16_t value, bool expect, uint64_t* selection);
+
+struct Kernels
+{
+	FnSectionBatch_Checksum* checksumSections;
+	FnPokemonBatch_Decrypt* decryptPokemon;
+	FnPokemonBatch_Encrypt* encryptPokemon;
+	FnColumn_Select* selectColumn;
+};
+
+static struct Kernels GKernels;
+
+static void
+SectionBatch_Checksum_Scalar(const struct Section* sections, size_t count, uint16_t* checksums)
+{
+	for (size_t i = 0; i < count; ++i)
+		checksums[i] = Section_CalculateChecksum(&sections[i]);
+}
+
+#if SIMD_X86
+TARGET_SSE2 static uint16_t
+Section_CalculateChecksum_SSE2(const struct Section* section)
+{
+	const byte* data = section->data;
+	size_t size = GSectionInfo[section->index].size;
+
+	__m128i sum0 = _mm_setzero_si128();
+	__m128i sum1 = _mm_setzero_si128();
+
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		sum0 = _mm_add_epi32(sum0, _mm_loadu_si128((const __m128i*)(data + i)));
+		sum1 = _mm_add_epi32(sum1, _mm_loadu_si128((const __m128i*)(data + i + 16)));
+	}
+	for (; i + 16 <= size; i += 16)
+		sum0 = _mm_add_epi32(sum0, _mm_loadu_si128((const __m128i*)(data + i)));
+
+	__m128i sum = _mm_add_epi32(sum0, sum1);
+	sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+	sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 4));
+
+	uint32_t checksum = (uint32_t)_mm_cvtsi128_si32(sum);
+	for (; i < size; i += 4)
+	{
+		uint32_t word;
+		memcpy(&word, data + i, sizeof(word));
+		checksum += word;
+	}
+
+	return (checksum & 0xFFFF) + (checksum >> 16);
+}
+
+TARGET_SSE2 static void
+SectionBatch_Checksum_SSE2(const struct Section* sections, size_t count, uint16_t* checksums)
+{
+	for (size_t i = 0; i < count; ++i)
+		checksums[i] = Section_CalculateChecksum_SSE2(&sections[i]);
+}
+
+TARGET_AVX2 static uint16_t
+Section_CalculateChecksum_AVX2(const struct Section* section)
+{
+	const byte* data = section->data;
+	size_t size = GSectionInfo[section->index].size;
+
+	__m256i sum0 = _mm256_setzero_si256();
+	__m256i sum1 = _mm256_setzero_si256();
+	__m256i sum2 = _mm256_setzero_si256();
+	__m256i sum3 = _mm256_setzero_si256();
+
+	size_t i = 0;
+	for (; i + 128 <= size; i += 128)
+	{
+		sum0 = _mm256_add_epi32(sum0, _mm256_loadu_si256((const __m256i*)(data + i)));
+		sum1 = _mm256_add_epi32(sum1, _mm256_loadu_si256((const __m256i*)(data + i + 32)));
+		sum2 = _mm256_add_epi32(sum2, _mm256_loadu_si256((const __m256i*)(data + i + 64)));
+		sum3 = _mm256_add_epi32(sum3, _mm256_loadu_si256((const __m256i*)(data + i + 96)));
+	}
+	for (; i + 32 <= size; i += 32)
+		sum0 = _mm256_add_epi32(sum0, _mm256_loadu_si256((const __m256i*)(data + i)));
+
+	__m256i sum256 = _mm256_add_epi32(_mm256_add_epi32(sum0, sum1), _mm256_add_epi32(sum2, sum3));
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sum256), _mm256_extracti128_si256(sum256, 1));
+
+	for (; i + 16 <= size; i += 16)
+		sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i*)(data + i)));
+
+	sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+	sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 4));
+
+	uint32_t checksum = (uint32_t)_mm_cvtsi128_si32(sum);
+	for (; i < size; i += 4)
+	{
+		uint32_t word;
+		memcpy(&word, data + i, sizeof(word));
+		checksum += word;
+	}
+
+	return (checksum & 0xFFFF) + (checksum >> 16);
+}
+
+TARGET_AVX2 static void
+SectionBatch_Checksum_AVX2(const struct Section* sections, size_t count, uint16_t* checksums)
+{
+	for (size_t i = 0; i < count; ++i)
+		checksums[i] = Section_CalculateChecksum_AVX2(&sections[i]);
+}
+#endif
+
+struct Save
+{
+	struct Section sections[SECTION_COUNT];
+};
+
+static bool
+Save_GetIndex(const struct Save* save, uint32_t* out)
+{
+	uint32_t index = save->sections[0].saveIndex;
+	for (size_t i = 1; i < SECTION_COUNT; ++i)
+		if (save->sections[i].saveIndex != index)
+			return false;
+	*out = index;
+	return true;
+}
+
+// Maps the sections of the save by index. Their checksums are verified
+// separately, once something reads them.
 static bool
 Save_GetSections(struct Save* save, struct Section** out)
 {
 	struct Section* sections[SECTION_COUNT];
 	memset(sections, 0, sizeof(sections));
 
+	for (size_t i = 0; i < SECTION_COUNT; ++i)
+		if (save->sections[i].index >= SECTION_COUNT)
+			return false;
+
 	for (size_t i = 0; i < SECTION_COUNT; ++i)
 	{
 		struct Section* section = &save->sections[i];
-
 		size_t index = section->index;
-		if (index >= SECTION_COUNT)
-			return false;
-
-		if (Section_CalculateChecksum(section) != section->checksum)
-			return false;
 
 		if (sections[index] != NULL)
 			return false;
@@ -287,60 +947,345 @@ struct Battery
 ASSERT_TYPE_SIZE(struct Battery, 128 * 1024);
 
 static bool
-Battery_Save(const struct Battery* battery, const char* file)
+Battery_GetCurrentSave(struct Battery* battery, struct Save** save)
 {
-	FILE* stream = fopen(file, "wb");
+	uint32_t index1;
+	struct Save* save1 = &battery->saves[0];
+	if (!Save_GetIndex(save1, &index1))
+		return false;
 
-	if (stream == NULL)
+	uint32_t index2;
+	struct Save* save2 = &battery->saves[1];
+	if (!Save_GetIndex(save2, &index2))
 		return false;
 
-	size_t count = fwrite(battery, sizeof(struct Battery), 1, stream);
+	*save = index1 > index2 ? save1 : save2;
+	return true;
+}
 
-	if (fclose(stream))
-		return false;
+#ifdef _WIN32
+typedef HANDLE File;
+#else
+typedef int File;
+#endif
 
-	return count == 1;
+// Opens an existing file, for writing too if writable is set. Read-only
+// opens allow another process to hold the file open for writing.
+static bool
+File_Open(File* file, const char* path, bool writable)
+{
+#ifdef _WIN32
+	DWORD access = writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+	DWORD share = writable ? FILE_SHARE_READ : FILE_SHARE_READ | FILE_SHARE_WRITE;
+	*file = CreateFileA(path, access, share, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	return *file != INVALID_HANDLE_VALUE;
+#else
+	*file = open(path, writable ? O_RDWR : O_RDONLY);
+	return *file != -1;
+#endif
 }
 
+// Creates the file for writing, replacing any existing one.
 static bool
-Battery_Load(struct Battery* battery, const char* file)
+File_Create(File* file, const char* path)
 {
-	FILE* stream = fopen(file, "rb");
+#ifdef _WIN32
+	*file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	return *file != INVALID_HANDLE_VALUE;
+#else
+	*file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	return *file != -1;
+#endif
+}
 
-	if (stream == NULL)
-		return false;
+static void
+File_Close(File file)
+{
+#ifdef _WIN32
+	CloseHandle(file);
+#else
+	close(file);
+#endif
+}
 
-	size_t count = fread(battery, sizeof(struct Battery), 1, stream);
+static bool
+File_WriteAt(File file, const void* data, size_t size, uint64_t offset)
+{
+	const byte* first = (const byte*)data;
+	const byte* last = first + size;
 
-	if (getc(stream) != EOF)
-		count = 0;
+	while (first != last)
+	{
+#ifdef _WIN32
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+		DWORD chunk = last - first > 0x40000000 ? 0x40000000 : (DWORD)(last - first);
+		DWORD written;
+		if (!WriteFile(file, first, chunk, &written, &overlapped) || written == 0)
+			return false;
+#else
+		ssize_t written = pwrite(file, first, last - first, (off_t)offset);
+		if (written <= 0)
+			return false;
+#endif
 
-	if (fclose(stream))
-		return false;
+		first += written;
+		offset += written;
+	}
 
-	return count == 1;
+	return true;
 }
 
 static bool
-Battery_GetCurrentSave(struct Battery* battery, struct Save** save)
+File_ReadAt(File file, void* data, size_t size, uint64_t offset)
 {
-	uint32_t index1;
-	struct Save* save1 = &battery->saves[0];
-	if (!Save_GetIndex(save1, &index1))
+	byte* first = (byte*)data;
+	byte* last = first + size;
+
+	while (first != last)
+	{
+#ifdef _WIN32
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+		DWORD chunk = last - first > 0x40000000 ? 0x40000000 : (DWORD)(last - first);
+		DWORD read;
+		if (!ReadFile(file, first, chunk, &read, &overlapped) || read == 0)
+			return false;
+#else
+		ssize_t read = pread(file, first, last - first, (off_t)offset);
+		if (read <= 0)
+			return false;
+#endif
+
+		first += read;
+		offset += read;
+	}
+
+	return true;
+}
+
+struct BatteryFile
+{
+	struct Battery* battery;
+	uint32_t dirty;
+
+	// Sections whose checksums have been verified.
+	uint32_t verified;
+
+	File file;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+};
+
+enum { BATTERY_SECTION_COUNT = sizeof(struct Battery) / sizeof(struct Section) };
+
+static bool
+BatteryFile_Open(struct BatteryFile* battery, const char* path, bool writable)
+{
+	battery->dirty = 0;
+	battery->verified = 0;
+
+	File file;
+	if (!File_Open(&file, path, writable))
 		return false;
 
-	uint32_t index2;
-	struct Save* save2 = &battery->saves[1];
-	if (!Save_GetIndex(save2, &index2))
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart != sizeof(struct Battery))
+	{
+		File_Close(file);
 		return false;
+	}
 
-	*save = index1 > index2 ? save1 : save2;
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+
+	if (mapping == NULL)
+	{
+		File_Close(file);
+		return false;
+	}
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, sizeof(struct Battery));
+
+	if (view == NULL)
+	{
+		CloseHandle(mapping);
+		File_Close(file);
+		return false;
+	}
+
+	battery->mapping = mapping;
+#else
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size != sizeof(struct Battery))
+	{
+		File_Close(file);
+		return false;
+	}
+
+	void* view = mmap(NULL, sizeof(struct Battery), PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+
+	if (view == MAP_FAILED)
+	{
+		File_Close(file);
+		return false;
+	}
+#endif
+
+	battery->battery = (struct Battery*)view;
+	battery->file = file;
+	return true;
+}
+
+static void
+BatteryFile_Close(struct BatteryFile* battery)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(battery->battery);
+	CloseHandle(battery->mapping);
+#else
+	munmap(battery->battery, sizeof(struct Battery));
+#endif
+	File_Close(battery->file);
+}
+
+static void
+BatteryFile_MarkSection(struct BatteryFile* battery, const struct Section* section)
+{
+	size_t index = section - (const struct Section*)battery->battery;
+	assert(index < BATTERY_SECTION_COUNT);
+	battery->dirty |= (uint32_t)1 << index;
+}
+
+// Verifies the checksums of the sections in mask, by section index, that
+// have not been verified before.
+static bool
+BatteryFile_VerifySections(struct BatteryFile* battery, struct Section* const* sections, uint32_t mask)
+{
+	for (size_t i = 0; i < SECTION_COUNT; ++i)
+	{
+		if ((mask >> i & 1) == 0)
+			continue;
+
+		const struct Section* section = sections[i];
+		size_t position = section - (const struct Section*)battery->battery;
+
+		if (battery->verified >> position & 1)
+			continue;
+
+		uint16_t checksum;
+		GKernels.checksumSections(section, 1, &checksum);
+
+		if (checksum != section->checksum)
+			return false;
+
+		battery->verified |= (uint32_t)1 << position;
+	}
+	return true;
+}
+
+static bool
+BatteryFile_Commit(struct BatteryFile* battery)
+{
+	const struct Section* sections = (const struct Section*)battery->battery;
+
+	for (size_t i = 0; i < BATTERY_SECTION_COUNT;)
+	{
+		if ((battery->dirty >> i & 1) == 0)
+		{
+			++i;
+			continue;
+		}
+
+		size_t first = i;
+		while (i < BATTERY_SECTION_COUNT && (battery->dirty >> i & 1) != 0)
+			++i;
+
+		if (!File_WriteAt(battery->file, &sections[first], (i - first) * sizeof(struct Section), first * sizeof(struct Section)))
+			return false;
+	}
+
+	battery->dirty = 0;
 	return true;
 }
 
 #define POKEMON_OT_NAME_SIZE 7
 #define POKEMON_NICKNAME_SIZE 10
 
+// The player, as stored at the start of the trainer section.
+struct Trainer
+{
+	byte name[POKEMON_OT_NAME_SIZE];
+	byte reserved1;
+	uint8_t gender;
+	byte reserved2;
+	uint16_t trainerPublic;
+	uint16_t trainerSecret;
+};
+
+// Section fields from index to the end.
+struct SectionFooter
+{
+	uint16_t index;
+	uint16_t checksum;
+	byte reserved2[4];
+	uint32_t saveIndex;
+};
+
+static_assert(sizeof(struct SectionFooter) == sizeof(struct Section) - offsetof(struct Section, index), "struct SectionFooter does not match struct Section");
+
+// Reads the trainer section of the current save, locating it from the
+// section footers. Only those and the one section are read, instead of
+// the whole battery.
+static bool
+Trainer_Read(const char* path, struct Trainer* trainer)
+{
+	File file;
+	if (!File_Open(&file, path, false))
+		return false;
+
+	struct SectionFooter footers[2][SECTION_COUNT];
+	bool result = true;
+
+	for (size_t i = 0; result && i < 2 * SECTION_COUNT; ++i)
+		result = File_ReadAt(file, &footers[i / SECTION_COUNT][i % SECTION_COUNT], sizeof(struct SectionFooter),
+			i * sizeof(struct Section) + offsetof(struct Section, index));
+
+	// As in Battery_GetCurrentSave, both saves must be consistent.
+	uint32_t indices[2];
+	for (size_t i = 0; result && i < 2; ++i)
+	{
+		indices[i] = footers[i][0].saveIndex;
+		for (size_t j = 1; j < SECTION_COUNT; ++j)
+			result &= footers[i][j].saveIndex == indices[i];
+	}
+
+	size_t save = result && indices[0] > indices[1] ? 0 : 1;
+	size_t position = 2 * SECTION_COUNT;
+
+	for (size_t i = 0; result && i < SECTION_COUNT; ++i)
+		if (footers[save][i].index == SECTION_TRAINER)
+			position = save * SECTION_COUNT + i;
+
+	struct Section section;
+	result = result && position != 2 * SECTION_COUNT
+		&& File_ReadAt(file, &section, sizeof(section), position * sizeof(struct Section))
+		&& Section_CalculateChecksum(&section) == section.checksum;
+
+	File_Close(file);
+
+	if (result)
+		memcpy(trainer, section.data, sizeof(*trainer));
+	return result;
+}
+
 struct Pokemon_Data
 {
 	byte reserved[12];
@@ -669,24 +1614,286 @@ Pokemon_Unscramble(struct Pokemon* pokemon)
 	pokemon->data.data[scramble[3]] = data[3];
 }
 
-struct PokemonInfo
+enum
 {
-	uint16_t index;
-	char name[POKEMON_NICKNAME_SIZE + 1];
+	POKEMON_BLOCK_GROWTH,
+	POKEMON_BLOCK_MOVES,
+	POKEMON_BLOCK_EFFORT,
+	POKEMON_BLOCK_MISC,
 };
 
-static const struct PokemonInfo GPokemon[] = {
-	{   0, "??????????" },
-	{   1, "Bulbasaur"  },
-	{   2, "Ivysaur"    },
-	{   3, "Venusaur"   },
-	{   4, "Charmander" },
-	{   5, "Charmeleon" },
-	{   6, "Charizard"  },
-	{   7, "Squirtle"   },
-	{   8, "Wartortle"  },
-	{   9, "Blastoise"  },
-	{  10, "Caterpie"   },
+static const uint8_t GUnscramble[24][4] = {
+	{ 0, 1, 2, 3 },
+	{ 0, 1, 3, 2 },
+	{ 0, 2, 1, 3 },
+	{ 0, 3, 1, 2 },
+	{ 0, 2, 3, 1 },
+	{ 0, 3, 2, 1 },
+	{ 1, 0, 2, 3 },
+	{ 1, 0, 3, 2 },
+	{ 2, 0, 1, 3 },
+	{ 3, 0, 1, 2 },
+	{ 2, 0, 3, 1 },
+	{ 3, 0, 2, 1 },
+	{ 1, 2, 0, 3 },
+	{ 1, 3, 0, 2 },
+	{ 2, 1, 0, 3 },
+	{ 3, 1, 0, 2 },
+	{ 2, 3, 0, 1 },
+	{ 3, 2, 0, 1 },
+	{ 1, 2, 3, 0 },
+	{ 1, 3, 2, 0 },
+	{ 2, 1, 3, 0 },
+	{ 3, 1, 2, 0 },
+	{ 2, 3, 1, 0 },
+	{ 3, 2, 1, 0 },
+};
+
+// Decrypts the aligned 32-bit word at offset within the given substructure.
+static uint32_t
+Pokemon_DecryptWord(const struct Pokemon* pokemon, size_t block, size_t offset)
+{
+	size_t position = GUnscramble[pokemon->personality % 24][block];
+
+	uint32_t word;
+	memcpy(&word, pokemon->data.data[position].reserved + offset, sizeof(word));
+
+	return word ^ pokemon->trainer ^ pokemon->personality;
+}
+
+static void
+PokemonBatch_Decrypt_Scalar(struct Pokemon* pokemon, size_t count, uint16_t* checksums)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		Pokemon_Decrypt(&pokemon[i]);
+		checksums[i] = Pokemon_CalculateChecksum(&pokemon[i]);
+	}
+}
+
+static void
+PokemonBatch_Encrypt_Scalar(struct Pokemon* pokemon, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		pokemon[i].checksum = Pokemon_CalculateChecksum(&pokemon[i]);
+		Pokemon_Encrypt(&pokemon[i]);
+	}
+}
+
+#if SIMD_X86
+TARGET_SSE2 static uint16_t
+Pokemon_Crypt_SSE2(struct Pokemon* pokemon, bool encrypt)
+{
+	__m128i* data = (__m128i*)&pokemon->data;
+	__m128i key = _mm_set1_epi32((int)(pokemon->trainer ^ pokemon->personality));
+
+	__m128i a = _mm_loadu_si128(data + 0);
+	__m128i b = _mm_loadu_si128(data + 1);
+	__m128i c = _mm_loadu_si128(data + 2);
+
+	if (!encrypt)
+	{
+		a = _mm_xor_si128(a, key);
+		b = _mm_xor_si128(b, key);
+		c = _mm_xor_si128(c, key);
+	}
+
+	__m128i sum = _mm_add_epi16(_mm_add_epi16(a, b), c);
+	sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+	sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 4));
+	sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 2));
+
+	if (encrypt)
+	{
+		a = _mm_xor_si128(a, key);
+		b = _mm_xor_si128(b, key);
+		c = _mm_xor_si128(c, key);
+	}
+
+	_mm_storeu_si128(data + 0, a);
+	_mm_storeu_si128(data + 1, b);
+	_mm_storeu_si128(data + 2, c);
+
+	return (uint16_t)_mm_cvtsi128_si32(sum);
+}
+
+TARGET_SSE2 static void
+PokemonBatch_Decrypt_SSE2(struct Pokemon* pokemon, size_t count, uint16_t* checksums)
+{
+	for (size_t i = 0; i < count; ++i)
+		checksums[i] = Pokemon_Crypt_SSE2(&pokemon[i], false);
+}
+
+TARGET_SSE2 static void
+PokemonBatch_Encrypt_SSE2(struct Pokemon* pokemon, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		pokemon[i].checksum = Pokemon_Crypt_SSE2(&pokemon[i], true);
+}
+
+// Processes two records at once, one per 128-bit lane.
+TARGET_AVX2 static void
+Pokemon_Crypt_AVX2(struct Pokemon* pokemon, bool encrypt, uint16_t* checksums)
+{
+	byte* data0 = (byte*)&pokemon[0].data;
+	byte* data1 = (byte*)&pokemon[1].data;
+
+	__m256i key = _mm256_inserti128_si256(
+		_mm256_castsi128_si256(_mm_set1_epi32((int)(pokemon[0].trainer ^ pokemon[0].personality))),
+		_mm_set1_epi32((int)(pokemon[1].trainer ^ pokemon[1].personality)), 1);
+
+	__m256i v[3];
+	for (size_t i = 0; i < 3; ++i)
+	{
+		v[i] = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(data0 + i * 16))),
+			_mm_loadu_si128((const __m128i*)(data1 + i * 16)), 1);
+
+		if (!encrypt)
+			v[i] = _mm256_xor_si256(v[i], key);
+	}
+
+	__m256i sum = _mm256_add_epi16(_mm256_add_epi16(v[0], v[1]), v[2]);
+	sum = _mm256_add_epi16(sum, _mm256_srli_si256(sum, 8));
+	sum = _mm256_add_epi16(sum, _mm256_srli_si256(sum, 4));
+	sum = _mm256_add_epi16(sum, _mm256_srli_si256(sum, 2));
+
+	checksums[0] = (uint16_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(sum));
+	checksums[1] = (uint16_t)_mm_cvtsi128_si32(_mm256_extracti128_si256(sum, 1));
+
+	for (size_t i = 0; i < 3; ++i)
+	{
+		if (encrypt)
+			v[i] = _mm256_xor_si256(v[i], key);
+
+		_mm_storeu_si128((__m128i*)(data0 + i * 16), _mm256_castsi256_si128(v[i]));
+		_mm_storeu_si128((__m128i*)(data1 + i * 16), _mm256_extracti128_si256(v[i], 1));
+	}
+}
+
+TARGET_AVX2 static void
+PokemonBatch_Decrypt_AVX2(struct Pokemon* pokemon, size_t count, uint16_t* checksums)
+{
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+		Pokemon_Crypt_AVX2(&pokemon[i], false, &checksums[i]);
+	PokemonBatch_Decrypt_SSE2(pokemon + i, count - i, checksums + i);
+}
+
+TARGET_AVX2 static void
+PokemonBatch_Encrypt_AVX2(struct Pokemon* pokemon, size_t count)
+{
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		uint16_t checksums[2];
+		Pokemon_Crypt_AVX2(&pokemon[i], true, checksums);
+		pokemon[i + 0].checksum = checksums[0];
+		pokemon[i + 1].checksum = checksums[1];
+	}
+	PokemonBatch_Encrypt_SSE2(pokemon + i, count - i);
+}
+#endif
+
+// Column kernels clear the selection bit of every row whose value does not
+// compare as expected. SIMD variants process whole vectors, so columns
+// must be padded to a multiple of 32 rows.
+static void
+Column_Select_Scalar(const uint16_t* column, size_t count, uint16_t value, bool expect, uint64_t* selection)
+{
+	for (size_t i = 0; i < count; ++i)
+		if ((column[i] == value) != expect)
+			selection[i / 64] &= ~((uint64_t)1 << i % 64);
+}
+
+#if SIMD_X86
+TARGET_SSE2 static void
+Column_Select_SSE2(const uint16_t* column, size_t count, uint16_t value, bool expect, uint64_t* selection)
+{
+	__m128i key = _mm_set1_epi16((short)value);
+	uint32_t invert = expect ? 0 : 0xFFFF;
+
+	for (size_t i = 0; i < count; i += 16)
+	{
+		__m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(column + i)), key);
+		__m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(column + i + 8)), key);
+
+		uint32_t match = ((uint32_t)_mm_movemask_epi8(_mm_packs_epi16(a, b)) ^ invert) & 0xFFFF;
+		selection[i / 64] &= ~((uint64_t)(match ^ 0xFFFF) << i % 64);
+	}
+}
+
+TARGET_AVX2 static void
+Column_Select_AVX2(const uint16_t* column, size_t count, uint16_t value, bool expect, uint64_t* selection)
+{
+	__m256i key = _mm256_set1_epi16((short)value);
+	uint32_t invert = expect ? 0 : UINT32_MAX;
+
+	for (size_t i = 0; i < count; i += 32)
+	{
+		__m256i a = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(column + i)), key);
+		__m256i b = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(column + i + 16)), key);
+
+		// Packing interleaves the 128-bit lanes; restore row order before
+		// extracting one bit per row.
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+
+		uint32_t match = (uint32_t)_mm256_movemask_epi8(packed) ^ invert;
+		selection[i / 64] &= ~((uint64_t)~match << i % 64);
+	}
+}
+#endif
+
+static void
+Kernels_Init(void)
+{
+	GKernels.checksumSections = SectionBatch_Checksum_Scalar;
+	GKernels.decryptPokemon = PokemonBatch_Decrypt_Scalar;
+	GKernels.encryptPokemon = PokemonBatch_Encrypt_Scalar;
+	GKernels.selectColumn = Column_Select_Scalar;
+
+	uint32_t features = Cpu_GetFeatures();
+
+#if SIMD_X86
+	if (features & CPU_SSE2)
+	{
+		GKernels.checksumSections = SectionBatch_Checksum_SSE2;
+		GKernels.decryptPokemon = PokemonBatch_Decrypt_SSE2;
+		GKernels.encryptPokemon = PokemonBatch_Encrypt_SSE2;
+		GKernels.selectColumn = Column_Select_SSE2;
+	}
+
+	if (features & CPU_AVX2)
+	{
+		GKernels.checksumSections = SectionBatch_Checksum_AVX2;
+		GKernels.decryptPokemon = PokemonBatch_Decrypt_AVX2;
+		GKernels.encryptPokemon = PokemonBatch_Encrypt_AVX2;
+		GKernels.selectColumn = Column_Select_AVX2;
+	}
+#else
+	UNUSED(features);
+#endif
+}
+
+struct PokemonInfo
+{
+	uint16_t index;
+	char name[POKEMON_NICKNAME_SIZE + 1];
+};
+
+static const struct PokemonInfo GPokemon[] = {
+	{   0, "??????????" },
+	{   1, "Bulbasaur"  },
+	{   2, "Ivysaur"    },
+	{   3, "Venusaur"   },
+	{   4, "Charmander" },
+	{   5, "Charmeleon" },
+	{   6, "Charizard"  },
+	{   7, "Squirtle"   },
+	{   8, "Wartortle"  },
+	{   9, "Blastoise"  },
+	{  10, "Caterpie"   },
 	{  11, "Metapod"    },
 	{  12, "Butterfree" },
 	{  13, "Weedle"     },
@@ -1095,576 +2302,5545 @@ static const struct PokemonInfo GPokemon[] = {
 #define STORAGE_BOX_COLS 6
 #define STORAGE_BOX_COUNT 14
 #define STORAGE_NAME_SIZE 9
+#define STORAGE_POKEMON_COUNT (STORAGE_BOX_SIZE * STORAGE_BOX_COUNT)
+
+struct SlotMask
+{
+	uint64_t bits[(STORAGE_POKEMON_COUNT + 63) / 64];
+};
+
+static void
+SlotMask_Clear(struct SlotMask* mask)
+{
+	memset(mask->bits, 0, sizeof(mask->bits));
+}
+
+static void
+SlotMask_Set(struct SlotMask* mask, size_t index)
+{
+	mask->bits[index / 64] |= (uint64_t)1 << index % 64;
+}
+
+static bool
+SlotMask_Test(const struct SlotMask* mask, size_t index)
+{
+	return (mask->bits[index / 64] >> index % 64 & 1) != 0;
+}
 
 struct PokemonStorage
 {
 	uint32_t current;
-	struct Pokemon pokemon[STORAGE_BOX_SIZE * STORAGE_BOX_COUNT];
+	struct Pokemon pokemon[STORAGE_POKEMON_COUNT];
 	byte names[STORAGE_NAME_SIZE * STORAGE_BOX_COUNT];
 	uint8_t wallpapers[STORAGE_BOX_COUNT];
 };
 
-static bool
-PokemonStorage_Save(const struct PokemonStorage* storage, struct Section* const* sections)
+// Records are read and written in place in the storage sections rather
+// than through a copy of the whole storage. A record at the end of one
+// section continues at the start of the next.
+static size_t
+PokemonStorage_GetOffset(size_t index)
 {
-	const byte* buffer = (const byte*)storage;
+	return offsetof(struct PokemonStorage, pokemon) + index * sizeof(struct Pokemon);
+}
 
-#define X_ENTRY(size, name, ...) { \
-		size_t index = SECTION_INDEX(name); \
-		struct Section* section = sections[index]; \
-		size_t offset = (index - SECTION_STORAGE1) * SECTION_STORAGE1_SIZE; \
-		memcpy(section->data, buffer + offset, SECTION_SIZE(name)); \
-		section->checksum = Section_CalculateChecksum(section); \
-	}
-	STORAGE_SECTIONS(X_ENTRY);
-#undef X_ENTRY
+static uint32_t
+PokemonStorage_GetSlotSections(const struct SlotMask* slots)
+{
+	uint32_t mask = 0;
+	for (size_t i = 0; i < STORAGE_POKEMON_COUNT; ++i)
+	{
+		if (!SlotMask_Test(slots, i))
+			continue;
 
-	return true;
+		size_t first = PokemonStorage_GetOffset(i);
+		size_t last = first + sizeof(struct Pokemon) - 1;
+
+		mask |= (uint32_t)1 << (SECTION_STORAGE1 + first / SECTION_STORAGE1_SIZE);
+		mask |= (uint32_t)1 << (SECTION_STORAGE1 + last / SECTION_STORAGE1_SIZE);
+	}
+	return mask;
 }
 
-static bool
-PokemonStorage_Load(struct PokemonStorage* storage, const struct Section* const* sections)
+// Returns the record at index in its section, or in scratch if it straddles
+// two sections.
+static const struct Pokemon*
+PokemonStorage_Get(struct Section* const* sections, size_t index, struct Pokemon* scratch)
 {
-	byte* buffer = (byte*)storage;
+	size_t offset = PokemonStorage_GetOffset(index);
+	size_t first = SECTION_STORAGE1 + offset / SECTION_STORAGE1_SIZE;
+	size_t position = offset % SECTION_STORAGE1_SIZE;
 
-#define X_ENTRY(size, name, ...) { \
-		size_t index = SECTION_INDEX(name); \
-		const struct Section* section = sections[index]; \
-		size_t offset = (index - SECTION_STORAGE1) * SECTION_STORAGE1_SIZE; \
-		memcpy(buffer + offset, section->data, SECTION_SIZE(name)); \
-	}
-	STORAGE_SECTIONS(X_ENTRY);
-#undef X_ENTRY
+	if (position + sizeof(struct Pokemon) <= SECTION_STORAGE1_SIZE)
+		return (const struct Pokemon*)(sections[first]->data + position);
 
-	return true;
+	size_t head = SECTION_STORAGE1_SIZE - position;
+	memcpy(scratch, sections[first]->data + position, head);
+	memcpy((byte*)scratch + head, sections[first + 1]->data, sizeof(struct Pokemon) - head);
+	return scratch;
 }
 
-static const byte GStringEncodeTable[256] = {
-	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+// Writes the record at index and returns the mask of the sections written.
+// Their checksums are left for the caller to update.
+static uint32_t
+PokemonStorage_Set(struct Section* const* sections, size_t index, const struct Pokemon* pokemon)
+{
+	size_t offset = PokemonStorage_GetOffset(index);
+	size_t first = SECTION_STORAGE1 + offset / SECTION_STORAGE1_SIZE;
+	size_t position = offset % SECTION_STORAGE1_SIZE;
 
-	0x00, 0xAB, 0xB2, 0x50, 0xB7, 0x5B, 0x2D, 0xB4, 0x5C, 0x5D, 0xAF, 0x2E, 0xB8, 0xAE, 0xAD, 0xBA,
-	0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xF0, 0x36, 0x85, 0x35, 0x86, 0xAC,
+	if (position + sizeof(struct Pokemon) <= SECTION_STORAGE1_SIZE)
+	{
+		memcpy(sections[first]->data + position, pokemon, sizeof(struct Pokemon));
+		return (uint32_t)1 << first;
+	}
 
-	0x50, 0xBB, 0xBC, 0xBD, 0xBE, 0xBF, 0xC0, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9,
-	0xCA, 0xCB, 0xCC, 0xCD, 0xCE, 0xCF, 0xD0, 0xD1, 0xD2, 0xD3, 0xD4, 0x5C, 0x50, 0x5D, 0x50, 0x50,
+	size_t head = SECTION_STORAGE1_SIZE - position;
+	memcpy(sections[first]->data + position, pokemon, head);
+	memcpy(sections[first + 1]->data, (const byte*)pokemon + head, sizeof(struct Pokemon) - head);
+	return (uint32_t)3 << first;
+}
 
-	0x50, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE, 0xDF, 0xE0, 0xE1, 0xE2, 0xE3,
-	0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xEB, 0xEC, 0xED, 0xEE, 0x5C, 0x50, 0x5D, 0x50, 0xFF,
+// Pokemon and checksums are scratch space for the whole storage.
+static bool
+PokemonStorage_Verify(struct Section* const* sections, struct Pokemon* pokemon, uint16_t* checksums)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < STORAGE_POKEMON_COUNT; ++i)
+	{
+		struct Pokemon scratch;
+		const struct Pokemon* stored = PokemonStorage_Get(sections, i, &scratch);
 
-	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+		if (Pokemon_Exists(stored))
+			pokemon[count++] = *stored;
+	}
 
-	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	GKernels.decryptPokemon(pokemon, count, checksums);
 
-	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	for (size_t i = 0; i < count; ++i)
+		if (checksums[i] != pokemon[i].checksum)
+			return false;
+	return true;
+}
 
-	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+// Identity of a battery file on disk. Any write to the file changes the
+// modification time, which invalidates snapshots taken under the old key.
+struct FileKey
+{
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size;
+	uint64_t modified;
+	uint64_t changed;
 };
 
-static void
-String_Encode(const char* string, size_t length, byte* buffer, size_t bufferSize)
+static bool
+FileKey_Get(const char* path, struct FileKey* key)
 {
-	if (bufferSize == 0)
-		return;
+	memset(key, 0, sizeof(*key));
 
-	byte* bufferLast = buffer + bufferSize;
-	const char* stringLast = string + length;
-	for (; buffer != bufferLast && string != stringLast; ++buffer, ++string)
-		if ((*buffer = GStringEncodeTable[*string]) == 0xFF)
-			return;
-	if (buffer != bufferLast)
-		*buffer = 0xFF;
-}
+#ifdef _WIN32
+	File file;
+	if (!File_Open(&file, path, false))
+		return false;
 
-static const char GStringDecodeTable[256] = {
-	0x20, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
-	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+	BY_HANDLE_FILE_INFORMATION info;
+	bool result = GetFileInformationByHandle(file, &info) != 0;
+	File_Close(file);
 
-	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x26, 0x2B, 0x1A,
-	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x3D, 0x3B, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+	if (!result)
+		return false;
 
-	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
-	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x25, 0x28, 0x29, 0x1A, 0x1A,
+	key->device = info.dwVolumeSerialNumber;
+	key->inode = (uint64_t)info.nFileIndexHigh << 32 | info.nFileIndexLow;
+	key->size = (uint64_t)info.nFileSizeHigh << 32 | info.nFileSizeLow;
+	key->modified = (uint64_t)info.ftLastWriteTime.dwHighDateTime << 32 | info.ftLastWriteTime.dwLowDateTime;
+	key->changed = (uint64_t)info.ftCreationTime.dwHighDateTime << 32 | info.ftCreationTime.dwLowDateTime;
+#else
+	struct stat status;
+	if (stat(path, &status) != 0)
+		return false;
 
-	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
-	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+	key->device = (uint64_t)status.st_dev;
+	key->inode = (uint64_t)status.st_ino;
+	key->size = (uint64_t)status.st_size;
+	key->modified = (uint64_t)status.st_mtim.tv_sec * 1000000000 + (uint64_t)status.st_mtim.tv_nsec;
+	key->changed = (uint64_t)status.st_ctim.tv_sec * 1000000000 + (uint64_t)status.st_ctim.tv_nsec;
+#endif
 
-	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x3C, 0x3E, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
-	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+	return true;
+}
 
-	0x1A, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x21, 0x3F, 0x2E, 0x2D, 0x2A,
-	0x1A, 0x22, 0x22, 0x27, 0x27, 0x1A, 0x1A, 0x24, 0x2C, 0x1A, 0x2F, 0x41, 0x42, 0x43, 0x44, 0x45,
+#define STORAGE_SNAPSHOT_MAGIC 0x32535150 // "PQS2"
 
-	0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55,
-	0x56, 0x57, 0x58, 0x59, 0x5A, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B,
+// The current storage of a verified save with every record decrypted
+// (but still scrambled) and the checksum computed over its plaintext.
+// Checksum covers everything after it, so that damaged cache files are
+// not trusted.
+struct StorageSnapshot
+{
+	uint32_t magic;
+	uint32_t size;
+	struct FileKey key;
+	uint32_t checksum;
 
-	0x6C, 0x6D, 0x6E, 0x6F, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x1A,
-	0x3A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x00,
+	uint16_t checksums[STORAGE_POKEMON_COUNT];
+	struct Pokemon pokemon[STORAGE_POKEMON_COUNT];
 };
 
+static_assert((sizeof(struct StorageSnapshot) - offsetof(struct StorageSnapshot, checksums)) % 4 == 0, "struct StorageSnapshot body is not made of whole words");
+
+// FNV-1a over the words of the body.
+static uint32_t
+StorageSnapshot_CalculateChecksum(const struct StorageSnapshot* snapshot)
+{
+	const byte* first = (const byte*)snapshot->checksums;
+	const byte* last = (const byte*)snapshot + sizeof(*snapshot);
+
+	uint32_t hash = 2166136261u;
+	for (; first != last; first += 4)
+	{
+		uint32_t word;
+		memcpy(&word, first, sizeof(word));
+		hash = (hash ^ word) * 16777619u;
+	}
+	return hash;
+}
+
 static void
-String_Decode(const byte* string, size_t length, char* buffer, size_t bufferSize)
+StorageSnapshot_Build(struct StorageSnapshot* snapshot, struct Section* const* sections, const struct FileKey* key)
 {
-	if (bufferSize == 0)
-		return;
+	snapshot->magic = STORAGE_SNAPSHOT_MAGIC;
+	snapshot->size = sizeof(struct StorageSnapshot);
+	snapshot->key = *key;
 
-	if (length >= bufferSize)
-		length = bufferSize - 1;
+	memset(snapshot->checksums, 0, sizeof(snapshot->checksums));
 
-	for (const byte* last = string + length; string != last; ++string)
+	uint16_t slots[STORAGE_POKEMON_COUNT];
+	struct Pokemon pokemon[STORAGE_POKEMON_COUNT];
+	uint16_t checksums[STORAGE_POKEMON_COUNT];
+
+	size_t count = 0;
+	for (size_t i = 0; i < STORAGE_POKEMON_COUNT; ++i)
 	{
-		byte input = *string;
+		struct Pokemon scratch;
+		const struct Pokemon* stored = PokemonStorage_Get(sections, i, &scratch);
+		snapshot->pokemon[i] = *stored;
 
-		if (input == 0xFF)
-			break;
+		if (!Pokemon_Exists(stored))
+			continue;
 
-		*buffer++ = GStringDecodeTable[input];
+		slots[count] = (uint16_t)i;
+		pokemon[count] = *stored;
+		++count;
 	}
 
-	*buffer = 0;
+	GKernels.decryptPokemon(pokemon, count, checksums);
+
+	for (size_t j = 0; j < count; ++j)
+	{
+		snapshot->pokemon[slots[j]] = pokemon[j];
+		snapshot->checksums[slots[j]] = checksums[j];
+	}
+
+	snapshot->checksum = StorageSnapshot_CalculateChecksum(snapshot);
+}
+
+static bool
+StorageSnapshot_Verify(const struct StorageSnapshot* snapshot)
+{
+	for (size_t i = 0; i < STORAGE_POKEMON_COUNT; ++i)
+	{
+		const struct Pokemon* pokemon = &snapshot->pokemon[i];
+		if (Pokemon_Exists(pokemon) && snapshot->checksums[i] != pokemon->checksum)
+			return false;
+	}
+	return true;
+}
+
+static bool
+StorageSnapshot_GetPath(const char* directory, const struct FileKey* key, struct Buffer* path)
+{
+	path->size = 0;
+	return Buffer_Printf(path, "%s/%016llx-%016llx.pqs", directory,
+		(unsigned long long)key->device, (unsigned long long)key->inode);
+}
+
+// Reads the cached snapshot for key. Fails if there is none or if it was
+// taken from a different version of the file. Path is scratch space.
+static bool
+StorageSnapshot_Read(struct StorageSnapshot* snapshot, const char* directory, const struct FileKey* key, struct Buffer* path)
+{
+	File file;
+	if (!StorageSnapshot_GetPath(directory, key, path) || !File_Open(&file, path->data, false))
+		return false;
+
+	bool result = File_ReadAt(file, snapshot, sizeof(*snapshot), 0)
+		&& snapshot->magic == STORAGE_SNAPSHOT_MAGIC
+		&& snapshot->size == sizeof(struct StorageSnapshot)
+		&& memcmp(&snapshot->key, key, sizeof(*key)) == 0
+		&& StorageSnapshot_CalculateChecksum(snapshot) == snapshot->checksum;
+
+	File_Close(file);
+	return result;
+}
+
+// Writes the snapshot to a temporary file and renames it into place, so
+// concurrent readers never observe a partial snapshot. Each writer has its
+// own temporary file, so neither a concurrent writer nor one left behind
+// by a crash can block the write. Path is scratch space.
+static bool
+StorageSnapshot_Write(const struct StorageSnapshot* snapshot, const char* directory, struct Buffer* path)
+{
+	struct Buffer temp;
+	Buffer_Init(&temp);
+
+	File file;
+	bool result = StorageSnapshot_GetPath(directory, &snapshot->key, path)
+		&& Buffer_Printf(&temp, "%s.%016llx.tmp", path->data, (unsigned long long)Thread_GetUniqueId())
+		&& File_Create(&file, temp.data);
+
+	if (result)
+	{
+		result = File_WriteAt(file, snapshot, sizeof(*snapshot), 0);
+		File_Close(file);
+
+#ifdef _WIN32
+		result = result && MoveFileExA(temp.data, path->data, MOVEFILE_REPLACE_EXISTING);
+
+		if (!result)
+			DeleteFileA(temp.data);
+#else
+		result = result && rename(temp.data, path->data) == 0;
+
+		if (!result)
+			unlink(temp.data);
+#endif
+	}
+
+	Buffer_Destroy(&temp);
+	return result;
+}
+
+#define POKEMON_COLUMNS(X) \
+	X(SPECIES) \
+	X(POKEDEX) \
+	X(TRAINER) \
+	X(GENDER) \
+	X(BALL) \
+	X(LEVEL) \
+	X(ITEM) \
+	X(IV_HP) \
+	X(IV_ATK) \
+	X(IV_DEF) \
+	X(IV_SPD) \
+	X(IV_SPATK) \
+	X(IV_SPDEF) \
+
+#define X_ENTRY(name, ...) POKEMON_COLUMN_##name,
+enum { POKEMON_COLUMNS(X_ENTRY) POKEMON_COLUMN_COUNT, POKEMON_COLUMN_NONE = POKEMON_COLUMN_COUNT };
+#undef X_ENTRY
+
+#define POKEMON_COLUMN_CAPACITY ((STORAGE_POKEMON_COUNT + 31) / 32 * 32)
+
+// Struct-of-arrays view of a batch of decrypted records, one 16-bit
+// column per decoded field.
+struct PokemonColumns
+{
+	size_t count;
+	uint16_t columns[POKEMON_COLUMN_COUNT][POKEMON_COLUMN_CAPACITY];
+};
+
+static uint32_t
+Pokemon_GetPlainWord(const struct Pokemon* pokemon, size_t block, size_t offset)
+{
+	size_t position = GUnscramble[pokemon->personality % 24][block];
+
+	uint32_t word;
+	memcpy(&word, pokemon->data.data[position].reserved + offset, sizeof(word));
+	return word;
+}
+
+// Fills the columns from records that are decrypted but still scrambled.
+static void
+PokemonColumns_Decode(struct PokemonColumns* columns, const struct Pokemon* pokemon, size_t count)
+{
+	uint16_t (*c)[POKEMON_COLUMN_CAPACITY] = columns->columns;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		const struct Pokemon* current = &pokemon[i];
+
+		uint32_t growth = Pokemon_GetPlainWord(current, POKEMON_BLOCK_GROWTH, 0);
+		uint32_t origin = Pokemon_GetPlainWord(current, POKEMON_BLOCK_MISC, 0) >> 16;
+		uint32_t values = Pokemon_GetPlainWord(current, POKEMON_BLOCK_MISC, offsetof(struct Pokemon_Misc, values));
+
+		uint16_t species = (uint16_t)growth;
+
+		c[POKEMON_COLUMN_SPECIES][i] = species;
+		c[POKEMON_COLUMN_POKEDEX][i] = species < ARRAY_SIZE(GPokemon) ? GPokemon[species].index : UINT16_MAX;
+		c[POKEMON_COLUMN_TRAINER][i] = current->trainerPublic;
+		c[POKEMON_COLUMN_GENDER][i] = GET_BITS(origin, 15, 1);
+		c[POKEMON_COLUMN_BALL][i] = GET_BITS(origin, 11, 4);
+		c[POKEMON_COLUMN_LEVEL][i] = GET_BITS(origin, 0, 7);
+		c[POKEMON_COLUMN_ITEM][i] = (uint16_t)(growth >> 16);
+		c[POKEMON_COLUMN_IV_HP][i] = GET_BITS(values, 0, 5);
+		c[POKEMON_COLUMN_IV_ATK][i] = GET_BITS(values, 5, 5);
+		c[POKEMON_COLUMN_IV_DEF][i] = GET_BITS(values, 10, 5);
+		c[POKEMON_COLUMN_IV_SPD][i] = GET_BITS(values, 15, 5);
+		c[POKEMON_COLUMN_IV_SPATK][i] = GET_BITS(values, 20, 5);
+		c[POKEMON_COLUMN_IV_SPDEF][i] = GET_BITS(values, 25, 5);
+	}
+
+	// Zero the padding read by the vector kernels.
+	size_t padding = (count + 31) / 32 * 32 - count;
+	for (size_t i = 0; i < POKEMON_COLUMN_COUNT; ++i)
+		memset(&c[i][count], 0, padding * sizeof(uint16_t));
+
+	columns->count = count;
+}
+
+static const byte GStringEncodeTable[256] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+
+	0x00, 0xAB, 0xB2, 0x50, 0xB7, 0x5B, 0x2D, 0xB4, 0x5C, 0x5D, 0xAF, 0x2E, 0xB8, 0xAE, 0xAD, 0xBA,
+	0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xF0, 0x36, 0x85, 0x35, 0x86, 0xAC,
+
+	0x50, 0xBB, 0xBC, 0xBD, 0xBE, 0xBF, 0xC0, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9,
+	0xCA, 0xCB, 0xCC, 0xCD, 0xCE, 0xCF, 0xD0, 0xD1, 0xD2, 0xD3, 0xD4, 0x5C, 0x50, 0x5D, 0x50, 0x50,
+
+	0x50, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE, 0xDF, 0xE0, 0xE1, 0xE2, 0xE3,
+	0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xEB, 0xEC, 0xED, 0xEE, 0x5C, 0x50, 0x5D, 0x50, 0xFF,
+
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+static void
+String_Encode(const char* string, size_t length, byte* buffer, size_t bufferSize)
+{
+	if (bufferSize == 0)
+		return;
+
+	byte* bufferLast = buffer + bufferSize;
+	const char* stringLast = string + length;
+	for (; buffer != bufferLast && string != stringLast; ++buffer, ++string)
+		if ((*buffer = GStringEncodeTable[(byte)*string]) == 0xFF)
+			return;
+	if (buffer != bufferLast)
+		*buffer = 0xFF;
+}
+
+// Encodes a name that must fit in the buffer whole, filling the rest of
+// the buffer with terminators. Returns the encoded length, or -1 if the
+// name is too long or has a character without an encoding.
+static size_t
+String_EncodeName(struct StringSpan name, byte* buffer, size_t bufferSize)
+{
+	if (name.size > bufferSize)
+		return (size_t)-1;
+
+	memset(buffer, 0xFF, bufferSize);
+
+	for (size_t i = 0; i < name.size; ++i)
+		if ((buffer[i] = GStringEncodeTable[(byte)name.data[i]]) == 0xFF)
+			return (size_t)-1;
+
+	return name.size;
+}
+
+static const char GStringDecodeTable[256] = {
+	0x20, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+
+	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x26, 0x2B, 0x1A,
+	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x3D, 0x3B, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+
+	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x25, 0x28, 0x29, 0x1A, 0x1A,
+
+	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+
+	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x3C, 0x3E, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+	0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A,
+
+	0x1A, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x21, 0x3F, 0x2E, 0x2D, 0x2A,
+	0x1A, 0x22, 0x22, 0x27, 0x27, 0x1A, 0x1A, 0x24, 0x2C, 0x1A, 0x2F, 0x41, 0x42, 0x43, 0x44, 0x45,
+
+	0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55,
+	0x56, 0x57, 0x58, 0x59, 0x5A, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B,
+
+	0x6C, 0x6D, 0x6E, 0x6F, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x1A,
+	0x3A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x1A, 0x00,
+};
+
+static void
+String_Decode(const byte* string, size_t length, char* buffer, size_t bufferSize)
+{
+	if (bufferSize == 0)
+		return;
+
+	if (length >= bufferSize)
+		length = bufferSize - 1;
+
+	for (const byte* last = string + length; string != last; ++string)
+	{
+		byte input = *string;
+
+		if (input == 0xFF)
+			break;
+
+		*buffer++ = GStringDecodeTable[input];
+	}
+
+	*buffer = 0;
+}
+
+struct OutputRow;
+
+typedef bool FnQueryRow(void* context, const struct OutputRow* row);
+
+// Destination of the rows produced for one file.
+struct QueryOutput
+{
+	struct Buffer* buffer;
+	const char* prefix;
+	uint32_t file;
+
+	// Rows are added to the aggregate or offered to the order heap instead
+	// of being written, if either is set.
+	struct Aggregate* aggregate;
+	struct OrderHeap* order;
+
+	// If ends is set, the end offset of each row written is appended to it
+	// and the query stops once it has written limit rows.
+	struct Buffer* ends;
+	size_t limit;
+
+	// If row is set, rows are passed to it instead of being written. The
+	// query stops before the first row for which it returns false.
+	FnQueryRow* row;
+	void* context;
+};
+
+enum FieldSource
+{
+	FIELD_SOURCE_BOX,
+	FIELD_SOURCE_SLOT,
+	FIELD_SOURCE_HEADER,
+	FIELD_SOURCE_DATA,
+	FIELD_SOURCE_POKEDEX,
+	FIELD_SOURCE_NAME,
+	FIELD_SOURCE_NICKNAME,
+	FIELD_SOURCE_TRAINER_NAME,
+};
+
+enum FieldType
+{
+	FIELD_TYPE_NUMBER,
+	FIELD_TYPE_STRING,
+	FIELD_TYPE_GENDER,
+};
+
+enum
+{
+	DECODE_NICKNAME = 1 << 0,
+	DECODE_TRAINER_NAME = 1 << 1,
+};
+
+// An output field. Numeric fields are read from the decrypted, still
+// scrambled record as bits [shift, shift + bits) of the word at offset.
+// Text width is the minimum width in the text format, digits for
+// numbers. Size is the width in the binary format.
+struct FieldInfo
+{
+	const char* name;
+	const char* key;
+	uint8_t source;
+	uint8_t type;
+	uint8_t block;
+	uint8_t offset;
+	uint8_t shift;
+	uint8_t bits;
+	uint8_t width;
+	uint8_t size;
+};
+
+#define FIELD_NUMBER(name, key, source, block, offset, shift, bits, width, size) \
+	{ name, key, source, FIELD_TYPE_NUMBER, block, offset, shift, bits, width, size }
+#define FIELD_STRING(name, key, source, width, size) \
+	{ name, key, source, FIELD_TYPE_STRING, 0, 0, 0, 0, width, size }
+
+#define FIELD_GROWTH(name, key, member, shift, bits, width, size) \
+	FIELD_NUMBER(name, key, FIELD_SOURCE_DATA, POKEMON_BLOCK_GROWTH, offsetof(struct Pokemon_Growth, member), shift, bits, width, size)
+#define FIELD_MOVES(name, key, index) \
+	FIELD_NUMBER(name, key, FIELD_SOURCE_DATA, POKEMON_BLOCK_MOVES, offsetof(struct Pokemon_Moves, moves) + index * 2, 0, 16, 3, 2)
+#define FIELD_MISC(name, key, member, shift, bits, width) \
+	FIELD_NUMBER(name, key, FIELD_SOURCE_DATA, POKEMON_BLOCK_MISC, offsetof(struct Pokemon_Misc, member), shift, bits, width, 1)
+
+static const struct FieldInfo GFields[] = {
+	FIELD_NUMBER("box", "box", FIELD_SOURCE_BOX, 0, 0, 0, 8, 2, 1),
+	FIELD_NUMBER("slot", "slot", FIELD_SOURCE_SLOT, 0, 0, 0, 8, 2, 1),
+	FIELD_NUMBER("personality", "personality", FIELD_SOURCE_HEADER, 0, offsetof(struct Pokemon, personality), 0, 32, 10, 4),
+	FIELD_NUMBER("trainer-id", "trainer_id", FIELD_SOURCE_HEADER, 0, offsetof(struct Pokemon, trainerPublic), 0, 16, 5, 2),
+	FIELD_NUMBER("secret-id", "secret_id", FIELD_SOURCE_HEADER, 0, offsetof(struct Pokemon, trainerSecret), 0, 16, 5, 2),
+	FIELD_GROWTH("species", "species", species, 0, 16, 3, 2),
+	FIELD_NUMBER("pokedex", "pokedex", FIELD_SOURCE_POKEDEX, 0, 0, 0, 16, 3, 2),
+	FIELD_STRING("name", "name", FIELD_SOURCE_NAME, POKEMON_NICKNAME_SIZE, POKEMON_NICKNAME_SIZE),
+	FIELD_STRING("nickname", "nickname", FIELD_SOURCE_NICKNAME, POKEMON_NICKNAME_SIZE, POKEMON_NICKNAME_SIZE),
+	FIELD_STRING("trainer-name", "trainer_name", FIELD_SOURCE_TRAINER_NAME, POKEMON_OT_NAME_SIZE, POKEMON_OT_NAME_SIZE + 1),
+	{ "trainer-gender", "trainer_gender", FIELD_SOURCE_DATA, FIELD_TYPE_GENDER, POKEMON_BLOCK_MISC, offsetof(struct Pokemon_Misc, origin), 15, 1, 1, 1 },
+	FIELD_GROWTH("held-item", "held_item", item, 0, 16, 3, 2),
+	FIELD_GROWTH("experience", "experience", experience, 0, 32, 7, 4),
+	FIELD_GROWTH("friendship", "friendship", friendship, 0, 8, 3, 1),
+	FIELD_MOVES("move1", "move1", 0),
+	FIELD_MOVES("move2", "move2", 1),
+	FIELD_MOVES("move3", "move3", 2),
+	FIELD_MOVES("move4", "move4", 3),
+	FIELD_MISC("met-location", "met_location", location, 0, 8, 3),
+	FIELD_MISC("met-level", "met_level", origin, 0, 7, 3),
+	FIELD_MISC("game", "game", origin, 7, 4, 2),
+	FIELD_MISC("ball", "ball", origin, 11, 4, 2),
+	FIELD_MISC("iv-hp", "iv_hp", values, 0, 5, 2),
+	FIELD_MISC("iv-atk", "iv_atk", values, 5, 5, 2),
+	FIELD_MISC("iv-def", "iv_def", values, 10, 5, 2),
+	FIELD_MISC("iv-spd", "iv_spd", values, 15, 5, 2),
+	FIELD_MISC("iv-spatk", "iv_spatk", values, 20, 5, 2),
+	FIELD_MISC("iv-spdef", "iv_spdef", values, 25, 5, 2),
+};
+
+#undef FIELD_MISC
+#undef FIELD_MOVES
+#undef FIELD_GROWTH
+#undef FIELD_STRING
+#undef FIELD_NUMBER
+
+struct FieldGroup
+{
+	const char* name;
+	const char* fields;
+};
+
+static const struct FieldGroup GFieldGroups[] = {
+	{ "ivs", "iv-hp iv-atk iv-def iv-spd iv-spatk iv-spdef" },
+	{ "moves", "move1 move2 move3 move4" },
+};
+
+static const struct FieldInfo*
+FieldInfo_Find(struct StringSpan name)
+{
+	for (size_t i = 0, c = ARRAY_SIZE(GFields); i < c; ++i)
+		if (StringSpan_Equals_CString(name, GFields[i].name))
+			return &GFields[i];
+	return NULL;
+}
+
+// The fields printed for each row, and what they require to be decoded.
+struct Projection
+{
+	size_t fieldCount;
+	const struct FieldInfo* fields[64];
+
+	bool selected;
+	uint32_t decode;
+};
+
+static bool
+Projection_Add(struct Projection* projection, const struct FieldInfo* field)
+{
+	if (projection->fieldCount == ARRAY_SIZE(projection->fields))
+		return false;
+
+	projection->fields[projection->fieldCount++] = field;
+
+	if (field->source == FIELD_SOURCE_NICKNAME)
+		projection->decode |= DECODE_NICKNAME;
+	if (field->source == FIELD_SOURCE_TRAINER_NAME)
+		projection->decode |= DECODE_TRAINER_NAME;
+
+	return true;
+}
+
+static bool
+Projection_AddList(struct Projection* projection, const char* list);
+
+// Adds a field or a group of fields by name.
+static bool
+Projection_AddName(struct Projection* projection, struct StringSpan name)
+{
+	const struct FieldInfo* field = FieldInfo_Find(name);
+	if (field != NULL)
+		return Projection_Add(projection, field);
+
+	for (size_t i = 0, c = ARRAY_SIZE(GFieldGroups); i < c; ++i)
+		if (StringSpan_Equals_CString(name, GFieldGroups[i].name))
+			return Projection_AddList(projection, GFieldGroups[i].fields);
+
+	return false;
+}
+
+// Adds each name in a space separated list.
+static bool
+Projection_AddList(struct Projection* projection, const char* list)
+{
+	struct StringSpan span = StringSpan_FromCString(list);
+	while (span.size != 0)
+	{
+		size_t length = StringSpan_FindChar(span, ' ');
+		if (length == (size_t)-1)
+			length = span.size;
+
+		if (!Projection_AddName(projection, StringSpan_Substring(span, 0, length)))
+			return false;
+
+		StringSpan_RemovePrefix(&span, length);
+		if (span.size != 0)
+			StringSpan_RemovePrefix(&span, 1);
+	}
+	return true;
+}
+
+// A decrypted record being printed. Strings are decoded only if the
+// projection needs them.
+struct OutputRow
+{
+	const struct Pokemon* pokemon;
+	size_t index;
+	char nickname[32];
+	char trainerName[32];
+};
+
+static void
+OutputRow_Init(struct OutputRow* row, const struct Pokemon* pokemon, size_t index, uint32_t decode)
+{
+	row->pokemon = pokemon;
+	row->index = index;
+
+	if (decode & DECODE_NICKNAME)
+	{
+		uint32_t values = Pokemon_GetPlainWord(pokemon, POKEMON_BLOCK_MISC, offsetof(struct Pokemon_Misc, values));
+
+		if (GET_BITS(values, 30, 1) && memcmp(pokemon->nickname, "\x60\x6F\x8B\xFF", 4) == 0)
+			strcpy(row->nickname, "@EGG");
+		else String_Decode(pokemon->nickname, POKEMON_NICKNAME_SIZE, row->nickname, sizeof(row->nickname));
+	}
+
+	if (decode & DECODE_TRAINER_NAME)
+		String_Decode(pokemon->trainerName, POKEMON_OT_NAME_SIZE, row->trainerName, sizeof(row->trainerName));
+}
+
+static const struct PokemonInfo*
+OutputRow_GetInfo(const struct OutputRow* row)
+{
+	uint32_t species = Pokemon_GetPlainWord(row->pokemon, POKEMON_BLOCK_GROWTH, 0) & 0xFFFF;
+	return &GPokemon[species < ARRAY_SIZE(GPokemon) ? species : 0];
+}
+
+static uint32_t
+OutputRow_GetNumber(const struct OutputRow* row, const struct FieldInfo* field)
+{
+	uint32_t word;
+	switch (field->source)
+	{
+	case FIELD_SOURCE_BOX:
+		return (uint32_t)(row->index / STORAGE_BOX_SIZE + 1);
+
+	case FIELD_SOURCE_SLOT:
+		return (uint32_t)(row->index % STORAGE_BOX_SIZE + 1);
+
+	case FIELD_SOURCE_POKEDEX:
+		return OutputRow_GetInfo(row)->index;
+
+	case FIELD_SOURCE_HEADER:
+		memcpy(&word, (const byte*)row->pokemon + (field->offset & ~3), sizeof(word));
+		break;
+
+	case FIELD_SOURCE_DATA:
+		word = Pokemon_GetPlainWord(row->pokemon, field->block, field->offset & ~3);
+		break;
+
+	default:
+		return 0;
+	}
+
+	word >>= (field->offset & 3) * 8 + field->shift;
+	return field->bits < 32 ? word & ~(UINT32_MAX << field->bits) : word;
+}
+
+static const char*
+OutputRow_GetString(const struct OutputRow* row, const struct FieldInfo* field)
+{
+	switch (field->source)
+	{
+	case FIELD_SOURCE_NAME:
+		return OutputRow_GetInfo(row)->name;
+
+	case FIELD_SOURCE_NICKNAME:
+		return row->nickname;
+
+	case FIELD_SOURCE_TRAINER_NAME:
+		return row->trainerName;
+	}
+	return "";
+}
+
+enum AggregateOp
+{
+	AGGREGATE_MIN,
+	AGGREGATE_MAX,
+	AGGREGATE_SUM,
+};
+
+static const char* const GAggregateOps[] = { "min", "max", "sum" };
+
+#define AGGREGATE_COLUMN_CAPACITY 8
+
+struct AggregateColumn
+{
+	uint8_t op;
+	const struct FieldInfo* field;
+};
+
+// Aggregation requested by the query. Each group reports its row count
+// followed by the columns. Without a group field all rows form one group.
+struct AggregateQuery
+{
+	bool enabled;
+	const struct FieldInfo* group;
+
+	size_t columnCount;
+	struct AggregateColumn columns[AGGREGATE_COLUMN_CAPACITY];
+};
+
+struct AggregateGroup
+{
+	uint32_t key;
+	uint64_t count;
+	uint64_t values[AGGREGATE_COLUMN_CAPACITY];
+};
+
+// Keys below this index a flat array, which covers the internal species
+// index used by GPokemon as well as every other narrow field. Wider keys
+// go to an open addressing hash table.
+#define AGGREGATE_DIRECT_SIZE 512
+
+struct Aggregate
+{
+	struct AggregateGroup direct[AGGREGATE_DIRECT_SIZE];
+
+	size_t hashCount;
+	size_t hashCapacity;
+	struct AggregateGroup* hash;
+};
+
+static void
+Aggregate_Init(struct Aggregate* aggregate)
+{
+	memset(aggregate->direct, 0, sizeof(aggregate->direct));
+	for (size_t i = 0; i < AGGREGATE_DIRECT_SIZE; ++i)
+		aggregate->direct[i].key = (uint32_t)i;
+
+	aggregate->hashCount = 0;
+	aggregate->hashCapacity = 0;
+	aggregate->hash = NULL;
+}
+
+static void
+Aggregate_Destroy(struct Aggregate* aggregate)
+{
+	free(aggregate->hash);
+}
+
+static struct AggregateGroup*
+Aggregate_Probe(struct AggregateGroup* hash, size_t capacity, uint32_t key)
+{
+	size_t index = (uint32_t)(key * 2654435761u) & (capacity - 1);
+
+	while (hash[index].count != 0 && hash[index].key != key)
+		index = (index + 1) & (capacity - 1);
+
+	return &hash[index];
+}
+
+// Returns the group for key. A new group has a count of zero and is only
+// considered used once its count is incremented.
+static struct AggregateGroup*
+Aggregate_Find(struct Aggregate* aggregate, uint32_t key)
+{
+	if (key < AGGREGATE_DIRECT_SIZE)
+		return &aggregate->direct[key];
+
+	if ((aggregate->hashCount + 1) * 4 > aggregate->hashCapacity * 3)
+	{
+		size_t capacity = aggregate->hashCapacity != 0 ? aggregate->hashCapacity * 2 : 64;
+
+		struct AggregateGroup* hash = (struct AggregateGroup*)calloc(capacity, sizeof(struct AggregateGroup));
+		if (hash == NULL)
+			return NULL;
+
+		for (size_t i = 0; i < aggregate->hashCapacity; ++i)
+			if (aggregate->hash[i].count != 0)
+				*Aggregate_Probe(hash, capacity, aggregate->hash[i].key) = aggregate->hash[i];
+
+		free(aggregate->hash);
+		aggregate->hash = hash;
+		aggregate->hashCapacity = capacity;
+	}
+
+	struct AggregateGroup* group = Aggregate_Probe(aggregate->hash, aggregate->hashCapacity, key);
+	if (group->count == 0)
+	{
+		group->key = key;
+		++aggregate->hashCount;
+	}
+	return group;
+}
+
+static void
+AggregateGroup_Combine(struct AggregateGroup* group, const struct AggregateQuery* query, uint64_t count, const uint64_t* values)
+{
+	for (size_t i = 0, c = query->columnCount; i < c; ++i)
+	{
+		uint64_t* value = &group->values[i];
+		switch (query->columns[i].op)
+		{
+		case AGGREGATE_MIN:
+			if (group->count == 0 || values[i] < *value)
+				*value = values[i];
+			break;
+
+		case AGGREGATE_MAX:
+			if (group->count == 0 || values[i] > *value)
+				*value = values[i];
+			break;
+
+		case AGGREGATE_SUM:
+			*value += values[i];
+			break;
+		}
+	}
+	group->count += count;
+}
+
+static bool
+Aggregate_Add(struct Aggregate* aggregate, const struct AggregateQuery* query, const struct OutputRow* row)
+{
+	uint64_t values[AGGREGATE_COLUMN_CAPACITY];
+	for (size_t i = 0, c = query->columnCount; i < c; ++i)
+		values[i] = OutputRow_GetNumber(row, query->columns[i].field);
+
+	uint32_t key = query->group != NULL ? OutputRow_GetNumber(row, query->group) : 0;
+
+	struct AggregateGroup* group = Aggregate_Find(aggregate, key);
+	if (group == NULL)
+		return false;
+
+	AggregateGroup_Combine(group, query, 1, values);
+	return true;
+}
+
+static bool
+Aggregate_Merge(struct Aggregate* aggregate, const struct Aggregate* source, const struct AggregateQuery* query)
+{
+	for (size_t i = 0, c = AGGREGATE_DIRECT_SIZE + source->hashCapacity; i < c; ++i)
+	{
+		const struct AggregateGroup* group = i < AGGREGATE_DIRECT_SIZE
+			? &source->direct[i] : &source->hash[i - AGGREGATE_DIRECT_SIZE];
+
+		if (group->count == 0)
+			continue;
+
+		struct AggregateGroup* target = Aggregate_Find(aggregate, group->key);
+		if (target == NULL)
+			return false;
+
+		AggregateGroup_Combine(target, query, group->count, group->values);
+	}
+	return true;
+}
+
+typedef bool FnFormatHeader(struct Buffer* buffer, const struct Projection* projection);
+typedef bool FnFormatRow(const struct QueryOutput* output, const struct Projection* projection, const struct OutputRow* row);
+
+static bool
+Format_TextDefault(const struct QueryOutput* output, const struct OutputRow* row)
+{
+	struct Buffer* buffer = output->buffer;
+	const struct PokemonInfo* info = OutputRow_GetInfo(row);
+
+	uint32_t origin = Pokemon_GetPlainWord(row->pokemon, POKEMON_BLOCK_MISC, 0) >> 16;
+
+	return Buffer_AppendUInt(buffer, (uint32_t)(row->index / STORAGE_BOX_SIZE + 1), 2)
+		&& Buffer_AppendChar(buffer, '/')
+		&& Buffer_AppendUInt(buffer, (uint32_t)(row->index % STORAGE_BOX_SIZE + 1), 2)
+		&& Buffer_Append(buffer, ": ", 2)
+		&& Buffer_AppendUInt(buffer, info->index, 3)
+		&& Buffer_AppendChar(buffer, ' ')
+		&& Buffer_AppendPadded(buffer, info->name, POKEMON_NICKNAME_SIZE)
+		&& Buffer_AppendChar(buffer, ' ')
+		&& Buffer_AppendPadded(buffer, row->nickname, POKEMON_NICKNAME_SIZE)
+		&& Buffer_Append(buffer, " from ", 6)
+		&& Buffer_AppendUInt(buffer, row->pokemon->trainerPublic, 5)
+		&& Buffer_AppendChar(buffer, ' ')
+		&& Buffer_AppendChar(buffer, GET_BITS(origin, 15, 1) ? 'F' : 'M')
+		&& Buffer_AppendChar(buffer, ' ')
+		&& Buffer_AppendPadded(buffer, row->trainerName, POKEMON_OT_NAME_SIZE)
+		&& Buffer_AppendChar(buffer, '\n');
+}
+
+static bool
+Format_Text(const struct QueryOutput* output, const struct Projection* projection, const struct OutputRow* row)
+{
+	struct Buffer* buffer = output->buffer;
+
+	if (output->prefix != NULL && !(Buffer_AppendString(buffer, output->prefix) && Buffer_Append(buffer, ": ", 2)))
+		return false;
+
+	if (!projection->selected)
+		return Format_TextDefault(output, row);
+
+	for (size_t i = 0; i < projection->fieldCount; ++i)
+	{
+		const struct FieldInfo* field = projection->fields[i];
+
+		if (i != 0 && !Buffer_AppendChar(buffer, ' '))
+			return false;
+
+		bool result;
+		switch (field->type)
+		{
+		case FIELD_TYPE_NUMBER:
+			result = Buffer_AppendUInt(buffer, OutputRow_GetNumber(row, field), field->width);
+			break;
+
+		case FIELD_TYPE_GENDER:
+			result = Buffer_AppendChar(buffer, OutputRow_GetNumber(row, field) ? 'F' : 'M');
+			break;
+
+		default:
+			result = Buffer_AppendPadded(buffer, OutputRow_GetString(row, field), i + 1 < projection->fieldCount ? field->width : 0);
+			break;
+		}
+
+		if (!result)
+			return false;
+	}
+
+	return Buffer_AppendChar(buffer, '\n');
+}
+
+static bool
+Json_AppendString(struct Buffer* buffer, const char* string)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	if (!Buffer_AppendChar(buffer, '"'))
+		return false;
+
+	for (; *string != 0; ++string)
+	{
+		byte ch = (byte)*string;
+		bool result;
+
+		if (ch == '"' || ch == '\\')
+		{
+			char escape[2] = { '\\', (char)ch };
+			result = Buffer_Append(buffer, escape, 2);
+		}
+		else if (ch < 0x20)
+		{
+			char escape[6] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 15] };
+			result = Buffer_Append(buffer, escape, 6);
+		}
+		else result = Buffer_AppendChar(buffer, (char)ch);
+
+		if (!result)
+			return false;
+	}
+
+	return Buffer_AppendChar(buffer, '"');
+}
+
+static bool
+Format_Json(const struct QueryOutput* output, const struct Projection* projection, const struct OutputRow* row)
+{
+	struct Buffer* buffer = output->buffer;
+
+	if (!Buffer_AppendChar(buffer, '{'))
+		return false;
+
+	if (output->prefix != NULL && !(Buffer_AppendString(buffer, "\"file\":") && Json_AppendString(buffer, output->prefix) && Buffer_AppendChar(buffer, ',')))
+		return false;
+
+	for (size_t i = 0; i < projection->fieldCount; ++i)
+	{
+		const struct FieldInfo* field = projection->fields[i];
+
+		bool result = (i == 0 || Buffer_AppendChar(buffer, ','))
+			&& Buffer_AppendChar(buffer, '"')
+			&& Buffer_AppendString(buffer, field->key)
+			&& Buffer_Append(buffer, "\":", 2);
+
+		switch (field->type)
+		{
+		case FIELD_TYPE_NUMBER:
+			result = result && Buffer_AppendUInt(buffer, OutputRow_GetNumber(row, field), 0);
+			break;
+
+		case FIELD_TYPE_GENDER:
+			result = result && Buffer_AppendString(buffer, OutputRow_GetNumber(row, field) ? "\"F\"" : "\"M\"");
+			break;
+
+		default:
+			result = result && Json_AppendString(buffer, OutputRow_GetString(row, field));
+			break;
+		}
+
+		if (!result)
+			return false;
+	}
+
+	return Buffer_Append(buffer, "}\n", 2);
+}
+
+static bool
+Csv_AppendString(struct Buffer* buffer, const char* string)
+{
+	if (strpbrk(string, ",\"\r\n") == NULL)
+		return Buffer_AppendString(buffer, string);
+
+	if (!Buffer_AppendChar(buffer, '"'))
+		return false;
+
+	for (; *string != 0; ++string)
+		if ((*string == '"' && !Buffer_AppendChar(buffer, '"')) || !Buffer_AppendChar(buffer, *string))
+			return false;
+
+	return Buffer_AppendChar(buffer, '"');
+}
+
+static bool
+Format_CsvHeader(struct Buffer* buffer, const struct Projection* projection)
+{
+	if (!Buffer_AppendString(buffer, "file"))
+		return false;
+
+	for (size_t i = 0; i < projection->fieldCount; ++i)
+		if (!Buffer_AppendChar(buffer, ',') || !Buffer_AppendString(buffer, projection->fields[i]->key))
+			return false;
+
+	return Buffer_AppendChar(buffer, '\n');
+}
+
+static bool
+Format_Csv(const struct QueryOutput* output, const struct Projection* projection, const struct OutputRow* row)
+{
+	struct Buffer* buffer = output->buffer;
+
+	if (output->prefix != NULL && !Csv_AppendString(buffer, output->prefix))
+		return false;
+
+	for (size_t i = 0; i < projection->fieldCount; ++i)
+	{
+		const struct FieldInfo* field = projection->fields[i];
+
+		bool result = Buffer_AppendChar(buffer, ',');
+
+		switch (field->type)
+		{
+		case FIELD_TYPE_NUMBER:
+			result = result && Buffer_AppendUInt(buffer, OutputRow_GetNumber(row, field), 0);
+			break;
+
+		case FIELD_TYPE_GENDER:
+			result = result && Buffer_AppendChar(buffer, OutputRow_GetNumber(row, field) ? 'F' : 'M');
+			break;
+
+		default:
+			result = result && Csv_AppendString(buffer, OutputRow_GetString(row, field));
+			break;
+		}
+
+		if (!result)
+			return false;
+	}
+
+	return Buffer_AppendChar(buffer, '\n');
+}
+
+#define FORMAT_BINARY_MAGIC 0x32425150 // "PQB2"
+
+// Records follow a header of the u32 magic, whose last character is the
+// layout version, and the u32 record size. Version 1 had fixed 32-byte
+// records without a header.
+static bool
+Format_BinaryHeader(struct Buffer* buffer, const struct Projection* projection)
+{
+	size_t size = sizeof(uint32_t);
+	for (size_t i = 0; i < projection->fieldCount; ++i)
+		size += projection->fields[i]->size;
+
+	return Buffer_AppendUInt32LE(buffer, FORMAT_BINARY_MAGIC)
+		&& Buffer_AppendUInt32LE(buffer, (uint32_t)((size + 3) & ~(size_t)3));
+}
+
+// Little-endian records: the u32 index of the file within the run, then
+// each projected field at its binary size, numbers as unsigned integers,
+// genders as 0 (male) or 1 (female) and strings NUL padded. Records are
+// zero padded to a multiple of four bytes. With the default projection:
+//   0  u32   file index
+//   4  u8    box
+//   5  u8    slot
+//   6  u16   internal species index
+//   8  u16   national pokedex number
+//  10  u16   trainer id
+//  12  u8    trainer gender
+//  13  char  nickname[10]
+//  23  char  trainer name[8]
+//  31  u8    padding
+static bool
+Format_Binary(const struct QueryOutput* output, const struct Projection* projection, const struct OutputRow* row)
+{
+	struct Buffer* buffer = output->buffer;
+	size_t first = buffer->size;
+
+	if (!Buffer_AppendUInt32LE(buffer, output->file))
+		return false;
+
+	for (size_t i = 0; i < projection->fieldCount; ++i)
+	{
+		const struct FieldInfo* field = projection->fields[i];
+
+		char data[16];
+		memset(data, 0, sizeof(data));
+
+		if (field->type == FIELD_TYPE_STRING)
+			strncpy(data, OutputRow_GetString(row, field), field->size);
+		else
+		{
+			uint32_t value = OutputRow_GetNumber(row, field);
+			for (size_t j = 0; j < field->size; ++j)
+				data[j] = (char)(value >> j * 8);
+		}
+
+		if (!Buffer_Append(buffer, data, field->size))
+			return false;
+	}
+
+	static const char padding[4] = { 0 };
+	return Buffer_Append(buffer, padding, (4 - (buffer->size - first) % 4) % 4);
+}
+
+typedef bool FnFormatAggregateHeader(struct Buffer* buffer, const struct AggregateQuery* query);
+typedef bool FnFormatAggregate(struct Buffer* buffer, const struct AggregateQuery* query, const struct AggregateGroup* group);
+
+static bool
+Aggregate_AppendName(struct Buffer* buffer, const struct AggregateColumn* column)
+{
+	return Buffer_AppendString(buffer, GAggregateOps[column->op])
+		&& Buffer_AppendChar(buffer, '_')
+		&& Buffer_AppendString(buffer, column->field->key);
+}
+
+// The minimum and maximum of a group without rows are undefined. Only the
+// single group of a query without a group field can be empty.
+static bool
+AggregateColumn_IsDefined(const struct AggregateColumn* column, const struct AggregateGroup* group)
+{
+	return group->count != 0 || column->op == AGGREGATE_SUM;
+}
+
+// Undefined values print as a dash.
+static bool
+Format_TextAggregate(struct Buffer* buffer, const struct AggregateQuery* query, const struct AggregateGroup* group)
+{
+	const struct FieldInfo* field = query->group;
+
+	if (field != NULL)
+	{
+		bool result = field->type == FIELD_TYPE_GENDER
+			? Buffer_AppendChar(buffer, group->key ? 'F' : 'M')
+			: Buffer_AppendUInt(buffer, group->key, field->width);
+
+		if (!result || !Buffer_AppendChar(buffer, ' '))
+			return false;
+	}
+
+	if (!Buffer_AppendUInt(buffer, group->count, 0))
+		return false;
+
+	for (size_t i = 0, c = query->columnCount; i < c; ++i)
+	{
+		bool result = Buffer_AppendChar(buffer, ' ')
+			&& (AggregateColumn_IsDefined(&query->columns[i], group)
+				? Buffer_AppendUInt(buffer, group->values[i], 0)
+				: Buffer_AppendChar(buffer, '-'));
+
+		if (!result)
+			return false;
+	}
+
+	return Buffer_AppendChar(buffer, '\n');
+}
+
+// Undefined values are null.
+static bool
+Format_JsonAggregate(struct Buffer* buffer, const struct AggregateQuery* query, const struct AggregateGroup* group)
+{
+	const struct FieldInfo* field = query->group;
+
+	if (!Buffer_AppendChar(buffer, '{'))
+		return false;
+
+	if (field != NULL)
+	{
+		bool result = Buffer_AppendChar(buffer, '"')
+			&& Buffer_AppendString(buffer, field->key)
+			&& Buffer_Append(buffer, "\":", 2)
+			&& (field->type == FIELD_TYPE_GENDER
+				? Buffer_AppendString(buffer, group->key ? "\"F\"" : "\"M\"")
+				: Buffer_AppendUInt(buffer, group->key, 0))
+			&& Buffer_AppendChar(buffer, ',');
+
+		if (!result)
+			return false;
+	}
+
+	if (!Buffer_AppendString(buffer, "\"count\":") || !Buffer_AppendUInt(buffer, group->count, 0))
+		return false;
+
+	for (size_t i = 0, c = query->columnCount; i < c; ++i)
+	{
+		bool result = Buffer_Append(buffer, ",\"", 2)
+			&& Aggregate_AppendName(buffer, &query->columns[i])
+			&& Buffer_Append(buffer, "\":", 2)
+			&& (AggregateColumn_IsDefined(&query->columns[i], group)
+				? Buffer_AppendUInt(buffer, group->values[i], 0)
+				: Buffer_AppendString(buffer, "null"));
+
+		if (!result)
+			return false;
+	}
+
+	return Buffer_Append(buffer, "}\n", 2);
+}
+
+static bool
+Format_CsvAggregateHeader(struct Buffer* buffer, const struct AggregateQuery* query)
+{
+	if (query->group != NULL && !(Buffer_AppendString(buffer, query->group->key) && Buffer_AppendChar(buffer, ',')))
+		return false;
+
+	if (!Buffer_AppendString(buffer, "count"))
+		return false;
+
+	for (size_t i = 0, c = query->columnCount; i < c; ++i)
+		if (!Buffer_AppendChar(buffer, ',') || !Aggregate_AppendName(buffer, &query->columns[i]))
+			return false;
+
+	return Buffer_AppendChar(buffer, '\n');
+}
+
+// Undefined values are left empty.
+static bool
+Format_CsvAggregate(struct Buffer* buffer, const struct AggregateQuery* query, const struct AggregateGroup* group)
+{
+	const struct FieldInfo* field = query->group;
+
+	if (field != NULL)
+	{
+		bool result = field->type == FIELD_TYPE_GENDER
+			? Buffer_AppendChar(buffer, group->key ? 'F' : 'M')
+			: Buffer_AppendUInt(buffer, group->key, 0);
+
+		if (!result || !Buffer_AppendChar(buffer, ','))
+			return false;
+	}
+
+	if (!Buffer_AppendUInt(buffer, group->count, 0))
+		return false;
+
+	for (size_t i = 0, c = query->columnCount; i < c; ++i)
+	{
+		if (!Buffer_AppendChar(buffer, ','))
+			return false;
+
+		if (AggregateColumn_IsDefined(&query->columns[i], group) && !Buffer_AppendUInt(buffer, group->values[i], 0))
+			return false;
+	}
+
+	return Buffer_AppendChar(buffer, '\n');
+}
+
+// Little-endian records: the u32 group key (zero without a group), four
+// reserved bytes, the u64 row count and a u64 per aggregate column. The
+// minimum and maximum of an empty group are zero.
+static bool
+Format_BinaryAggregate(struct Buffer* buffer, const struct AggregateQuery* query, const struct AggregateGroup* group)
+{
+	if (!Buffer_AppendUInt32LE(buffer, group->key) || !Buffer_AppendUInt32LE(buffer, 0))
+		return false;
+
+	if (!Buffer_AppendUInt64LE(buffer, group->count))
+		return false;
+
+	for (size_t i = 0, c = query->columnCount; i < c; ++i)
+		if (!Buffer_AppendUInt64LE(buffer, group->values[i]))
+			return false;
+
+	return true;
+}
+
+// Default projections hold the fields printed when there is no select
+// clause. The text format prints them in its own fixed layout.
+struct FormatInfo
+{
+	const char* name;
+	FnFormatHeader* header;
+	FnFormatRow* row;
+	FnFormatAggregateHeader* aggregateHeader;
+	FnFormatAggregate* aggregate;
+	const char* defaults;
+	bool binary;
+};
+
+static const struct FormatInfo GFormats[] = {
+	{ "text", NULL, Format_Text, NULL, Format_TextAggregate, "pokedex name nickname trainer-id trainer-gender trainer-name", false },
+	{ "jsonl", NULL, Format_Json, NULL, Format_JsonAggregate, "box slot species pokedex name nickname trainer-id trainer-gender trainer-name", false },
+	{ "csv", Format_CsvHeader, Format_Csv, Format_CsvAggregateHeader, Format_CsvAggregate, "box slot species pokedex name nickname trainer-id trainer-gender trainer-name", false },
+	{ "binary", Format_BinaryHeader, Format_Binary, NULL, Format_BinaryAggregate, "box slot species pokedex trainer-id trainer-gender nickname trainer-name", true },
+};
+
+static int
+AggregateGroup_Compare(const void* lhs, const void* rhs)
+{
+	uint32_t a = (*(const struct AggregateGroup* const*)lhs)->key;
+	uint32_t b = (*(const struct AggregateGroup* const*)rhs)->key;
+	return (a > b) - (a < b);
+}
+
+// Writes the groups in key order. A query without a group field always
+// reports its single group, even if no rows matched.
+static bool
+Aggregate_Write(const struct Aggregate* aggregate, const struct AggregateQuery* query, const struct FormatInfo* format, struct Buffer* buffer)
+{
+	if (format->aggregateHeader != NULL && !format->aggregateHeader(buffer, query))
+		return false;
+
+	if (query->group == NULL)
+		return format->aggregate(buffer, query, &aggregate->direct[0]);
+
+	for (size_t i = 0; i < AGGREGATE_DIRECT_SIZE; ++i)
+		if (aggregate->direct[i].count != 0 && !format->aggregate(buffer, query, &aggregate->direct[i]))
+			return false;
+
+	if (aggregate->hashCount == 0)
+		return true;
+
+	const struct AggregateGroup** groups = (const struct AggregateGroup**)malloc(aggregate->hashCount * sizeof(struct AggregateGroup*));
+	if (groups == NULL)
+		return false;
+
+	size_t count = 0;
+	for (size_t i = 0; i < aggregate->hashCapacity; ++i)
+		if (aggregate->hash[i].count != 0)
+			groups[count++] = &aggregate->hash[i];
+
+	qsort(groups, count, sizeof(struct AggregateGroup*), AggregateGroup_Compare);
+
+	bool result = true;
+	for (size_t i = 0; result && i < count; ++i)
+		result = format->aggregate(buffer, query, groups[i]);
+
+	free((void*)groups);
+	return result;
+}
+
+// Sort order of the rows. Ordered queries are always limited, so that
+// only the best rows need to be kept.
+struct OrderQuery
+{
+	const struct FieldInfo* field;
+	bool descending;
+};
+
+struct OrderKey
+{
+	uint32_t value;
+	uint32_t file;
+	size_t index;
+};
+
+struct OrderEntry
+{
+	struct OrderKey key;
+	struct Pokemon pokemon;
+};
+
+// Bounded heap of the best rows seen so far. The root holds the row that
+// would be dropped next.
+struct OrderHeap
+{
+	size_t count;
+	size_t capacity;
+	struct OrderEntry* entries;
+};
+
+static bool
+OrderHeap_Init(struct OrderHeap* heap, size_t capacity)
+{
+	heap->entries = (struct OrderEntry*)malloc(capacity * sizeof(struct OrderEntry));
+	if (heap->entries == NULL)
+		return false;
+
+	heap->count = 0;
+	heap->capacity = capacity;
+	return true;
+}
+
+static void
+OrderHeap_Destroy(struct OrderHeap* heap)
+{
+	free(heap->entries);
+}
+
+// Ties are broken by position, so that the result does not depend on the
+// order in which files are scanned.
+static bool
+OrderKey_Before(const struct OrderQuery* query, const struct OrderKey* lhs, const struct OrderKey* rhs)
+{
+	if (lhs->value != rhs->value)
+		return query->descending ? lhs->value > rhs->value : lhs->value < rhs->value;
+
+	if (lhs->file != rhs->file)
+		return lhs->file < rhs->file;
+
+	return lhs->index < rhs->index;
+}
+
+static void
+OrderHeap_SiftDown(struct OrderHeap* heap, const struct OrderQuery* query, size_t i, size_t count)
+{
+	struct OrderEntry* entries = heap->entries;
+	struct OrderEntry entry = entries[i];
+
+	for (size_t child; (child = i * 2 + 1) < count; i = child)
+	{
+		if (child + 1 < count && OrderKey_Before(query, &entries[child].key, &entries[child + 1].key))
+			++child;
+
+		if (!OrderKey_Before(query, &entry.key, &entries[child].key))
+			break;
+
+		entries[i] = entries[child];
+	}
+	entries[i] = entry;
+}
+
+// Offers a row to the heap. The record is only copied if it is kept.
+static void
+OrderHeap_Push(struct OrderHeap* heap, const struct OrderQuery* query, const struct OrderKey* key, const struct Pokemon* pokemon)
+{
+	struct OrderEntry* entries = heap->entries;
+
+	if (heap->count == heap->capacity)
+	{
+		if (heap->count == 0 || !OrderKey_Before(query, key, &entries[0].key))
+			return;
+
+		entries[0].key = *key;
+		entries[0].pokemon = *pokemon;
+		OrderHeap_SiftDown(heap, query, 0, heap->count);
+		return;
+	}
+
+	size_t i = heap->count++;
+	for (; i > 0; i = (i - 1) / 2)
+	{
+		struct OrderEntry* parent = &entries[(i - 1) / 2];
+
+		if (!OrderKey_Before(query, &parent->key, key))
+			break;
+
+		entries[i] = *parent;
+	}
+
+	entries[i].key = *key;
+	entries[i].pokemon = *pokemon;
+}
+
+static void
+OrderHeap_Merge(struct OrderHeap* heap, const struct OrderHeap* source, const struct OrderQuery* query)
+{
+	for (size_t i = 0; i < source->count; ++i)
+		OrderHeap_Push(heap, query, &source->entries[i].key, &source->entries[i].pokemon);
+}
+
+// Sorts the entries in place, best first. The heap cannot be pushed to
+// afterwards.
+static void
+OrderHeap_Sort(struct OrderHeap* heap, const struct OrderQuery* query)
+{
+	struct OrderEntry* entries = heap->entries;
+
+	for (size_t count = heap->count; count > 1; --count)
+	{
+		struct OrderEntry last = entries[count - 1];
+		entries[count - 1] = entries[0];
+		entries[0] = last;
+		OrderHeap_SiftDown(heap, query, 0, count - 1);
+	}
 }
 
 #define CONTEXT_SIZE (sizeof(void*) * 2)
 #define CONTEXT(type) (*(sizeof(int[sizeof(type) <= CONTEXT_SIZE ? 1 : -1]), (const type*)context))
 #define CONTEXT_SET(type) (*(sizeof(int[sizeof(type) <= CONTEXT_SIZE ? 1 : -1]), (type*)context))
 
-typedef bool FnParseContext(void* context, struct StringSpan text);
+typedef bool FnParseContext(void* context, struct StringSpan text);
+
+static bool
+ParseContext_StringSpan(void* context, struct StringSpan text)
+{
+	CONTEXT_SET(struct StringSpan) = text;
+	return true;
+}
+
+static bool
+ParseContext_uint8(void* context, struct StringSpan text)
+{
+	uint32_t value;
+	bool result = ParseUInt32(text, 10, UINT8_MAX, &value);
+	*(uint8_t*)context = (uint8_t)value;
+	return result;
+}
+
+static bool
+ParseContext_uint16(void* context, struct StringSpan text)
+{
+	uint32_t value;
+	bool result = ParseUInt32(text, 10, UINT16_MAX, &value);
+	*(uint16_t*)context = (uint16_t)value;
+	return result;
+}
+
+static bool
+ParseContext_uint32(void* context, struct StringSpan text)
+{
+	return ParseUInt32(text, 10, 0, (uint32_t*)context);
+}
+
+static bool
+ParseContext_Gender(void* context, struct StringSpan text)
+{
+	if (text.size != 1)
+		return false;
+
+	bool gender;
+	switch (*text.data)
+	{
+	case 'm':
+	case 'M':
+		gender = false;
+		break;
+
+	case 'f':
+	case 'F':
+		gender = true;
+		break;
+
+	default:
+		return false;
+	}
+
+	CONTEXT_SET(bool) = gender;
+	return true;
+}
+
+// Parses a gender as a 16-bit set key.
+static bool
+ParseContext_GenderKey(void* context, struct StringSpan text)
+{
+	bool gender;
+	if (!ParseContext_Gender(&gender, text))
+		return false;
+
+	*(uint16_t*)context = gender;
+	return true;
+}
+
+// Stores a number as the context that parse would produce, so that filters
+// and actions can be built without formatting their values as text.
+static bool
+Context_SetNumber(void* context, FnParseContext* parse, uint32_t value)
+{
+	if (parse == ParseContext_uint8 && value <= UINT8_MAX)
+		CONTEXT_SET(uint8_t) = (uint8_t)value;
+	else if ((parse == ParseContext_uint16 || parse == ParseContext_GenderKey) && value <= UINT16_MAX)
+		CONTEXT_SET(uint16_t) = (uint16_t)value;
+	else if (parse == ParseContext_uint32)
+		CONTEXT_SET(uint32_t) = value;
+	else if (parse == ParseContext_Gender && value <= 1)
+		CONTEXT_SET(bool) = value != 0;
+	else return false;
+	return true;
+}
+
+typedef void FnAction(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context);
+
+enum FilterStage
+{
+	FILTER_STAGE_INDEX,
+	FILTER_STAGE_HEADER,
+	FILTER_STAGE_FIELD,
+	FILTER_STAGE_DECODED,
+
+	FILTER_STAGE_COUNT
+};
+
+// Bit set over a 16-bit key space. In and between predicates test keys
+// against one, so that a lookup costs the same however many keys match.
+struct FilterSet
+{
+	uint64_t bits[(UINT16_MAX + 1) / 64];
+};
+
+static void
+FilterSet_Add(struct FilterSet* set, uint32_t key)
+{
+	set->bits[key / 64] |= (uint64_t)1 << key % 64;
+}
+
+static bool
+FilterSet_Test(const struct FilterSet* set, uint32_t key)
+{
+	return key <= UINT16_MAX && (set->bits[key / 64] >> key % 64 & 1) != 0;
+}
+
+enum FilterOpCode
+{
+	FILTER_OP_FALSE,
+	FILTER_OP_BOX,
+	FILTER_OP_SLOT,
+	FILTER_OP_HEADER,
+	FILTER_OP_FIELD,
+	FILTER_OP_POKEDEX,
+};
+
+// A compiled predicate: ((load(op) & mask) == value) == expect.
+// Field offsets are rounded down to the containing word and the mask and
+// value are shifted into place, so evaluation never shifts or converts.
+// Ops that test a decoded field also name the column holding it and the
+// unshifted value, for use by the columnar scan.
+// Set ops instead test ((load(op) & mask) >> shift) against the set, as
+// does the columnar scan with the column values.
+struct FilterOp
+{
+	uint8_t code;
+	uint8_t stage;
+	uint8_t block;
+	uint8_t offset;
+	bool expect;
+	uint8_t column;
+	uint16_t key;
+	uint32_t mask;
+	uint32_t value;
+	uint8_t shift;
+	const struct FilterSet* set;
+};
+
+static void
+FilterOp_Init(struct FilterOp* op, enum FilterOpCode code, enum FilterStage stage, uint32_t value)
+{
+	op->code = (uint8_t)code;
+	op->stage = (uint8_t)stage;
+	op->block = 0;
+	op->offset = 0;
+	op->expect = true;
+	op->column = POKEMON_COLUMN_NONE;
+	op->key = 0;
+	op->mask = UINT32_MAX;
+	op->value = value;
+	op->shift = 0;
+	op->set = NULL;
+}
+
+static void
+FilterOp_SetColumn(struct FilterOp* op, size_t column, uint16_t key)
+{
+	op->column = (uint8_t)column;
+	op->key = key;
+}
+
+static void
+FilterOp_SetKeys(struct FilterOp* op, const struct FilterSet* set)
+{
+	uint8_t shift = 0;
+	while (shift < 31 && (op->mask >> shift & 1) == 0)
+		++shift;
+
+	op->value = 0;
+	op->shift = shift;
+	op->set = set;
+}
+
+static void
+FilterOp_InitField(struct FilterOp* op, enum FilterOpCode code, enum FilterStage stage, size_t block, size_t offset, size_t shift, size_t bits, uint32_t value)
+{
+	FilterOp_Init(op, code, stage, 0);
+	op->block = (uint8_t)block;
+	op->offset = (uint8_t)(offset & ~(size_t)3);
+
+	uint32_t mask = bits < 32 ? ~(UINT32_MAX << bits) : UINT32_MAX;
+	shift += (offset & 3) * 8;
+
+	op->mask = mask << shift;
+	op->value = (value & mask) << shift;
+}
+
+// Reads the word an op compares. Records are either as stored, or
+// decrypted but still scrambled.
+static uint32_t
+FilterOp_Load(const struct FilterOp* op, const struct Pokemon* pokemon, size_t index, bool decrypted)
+{
+	uint32_t word;
+	switch (op->code)
+	{
+	case FILTER_OP_BOX:
+		return (uint32_t)(index / STORAGE_BOX_SIZE + 1);
+
+	case FILTER_OP_SLOT:
+		return (uint32_t)(index % STORAGE_BOX_SIZE + 1);
+
+	case FILTER_OP_HEADER:
+		memcpy(&word, (const byte*)pokemon + op->offset, sizeof(word));
+		return word;
+
+	case FILTER_OP_FIELD:
+		return decrypted
+			? Pokemon_GetPlainWord(pokemon, op->block, op->offset)
+			: Pokemon_DecryptWord(pokemon, op->block, op->offset);
+
+	case FILTER_OP_POKEDEX:
+		word = decrypted
+			? Pokemon_GetPlainWord(pokemon, POKEMON_BLOCK_GROWTH, offsetof(struct Pokemon_Growth, species))
+			: Pokemon_DecryptWord(pokemon, POKEMON_BLOCK_GROWTH, offsetof(struct Pokemon_Growth, species));
+		word &= 0xFFFF;
+		return word < ARRAY_SIZE(GPokemon) ? GPokemon[word].index : UINT32_MAX;
+	}
+	return ~op->value;
+}
+
+static bool
+FilterOp_Execute(const struct FilterOp* op, const struct Pokemon* pokemon, size_t index, bool decrypted)
+{
+	uint32_t word = FilterOp_Load(op, pokemon, index, decrypted) & op->mask;
+
+	if (op->set != NULL)
+		return FilterSet_Test(op->set, word >> op->shift) == op->expect;
+
+	return (word == op->value) == op->expect;
+}
+
+// Relative cost of an op. Index compares need no record, header compares
+// read plaintext and field compares decrypt a word first.
+static uint16_t
+FilterOp_GetCost(const struct FilterOp* op)
+{
+	switch (op->code)
+	{
+	case FILTER_OP_FALSE:
+	case FILTER_OP_BOX:
+	case FILTER_OP_SLOT:
+		return 1;
+
+	case FILTER_OP_HEADER:
+		return 2;
+
+	case FILTER_OP_FIELD:
+		return 4;
+
+	case FILTER_OP_POKEDEX:
+		return 5;
+	}
+	return 8;
+}
+
+typedef void FnCompileFilter(struct FilterOp* op, const void* context);
+
+struct Filter
+{
+	FnCompileFilter* compile;
+	byte context[CONTEXT_SIZE];
+};
+
+static void
+Filters_Box(struct FilterOp* op, const void* context)
+{
+	FilterOp_Init(op, FILTER_OP_BOX, FILTER_STAGE_INDEX, CONTEXT(uint32_t));
+}
+
+static void
+Filters_Slot(struct FilterOp* op, const void* context)
+{
+	FilterOp_Init(op, FILTER_OP_SLOT, FILTER_STAGE_INDEX, CONTEXT(uint32_t));
+}
+
+static void
+Filters_Pokedex(struct FilterOp* op, const void* context)
+{
+	uint16_t number = CONTEXT(uint16_t);
+
+	// Resolve the national dex number to the internal species index so
+	// that the scan compares the raw field. Numbers shared by several
+	// internal indices fall back to a table lookup per record.
+	size_t species = 0;
+	size_t count = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(GPokemon); ++i)
+	{
+		if (GPokemon[i].index == number)
+		{
+			species = i;
+			++count;
+		}
+	}
+
+	if (count == 0)
+		FilterOp_Init(op, FILTER_OP_FALSE, FILTER_STAGE_INDEX, 0);
+	else if (count == 1)
+		FilterOp_InitField(op, FILTER_OP_FIELD, FILTER_STAGE_FIELD, POKEMON_BLOCK_GROWTH,
+			offsetof(struct Pokemon_Growth, species), 0, 16, (uint32_t)species);
+	else FilterOp_Init(op, FILTER_OP_POKEDEX, FILTER_STAGE_FIELD, number);
+
+	FilterOp_SetColumn(op, POKEMON_COLUMN_POKEDEX, number);
+}
+
+static void
+Filters_HeldItem(struct FilterOp* op, const void* context)
+{
+	FilterOp_InitField(op, FILTER_OP_FIELD, FILTER_STAGE_FIELD, POKEMON_BLOCK_GROWTH,
+		offsetof(struct Pokemon_Growth, item), 0, 16, CONTEXT(uint16_t));
+	FilterOp_SetColumn(op, POKEMON_COLUMN_ITEM, CONTEXT(uint16_t));
+}
+
+static void
+Filters_Trainer(struct FilterOp* op, const void* context)
+{
+	FilterOp_InitField(op, FILTER_OP_HEADER, FILTER_STAGE_HEADER, 0,
+		offsetof(struct Pokemon, trainerPublic), 0, 16, CONTEXT(uint16_t));
+	FilterOp_SetColumn(op, POKEMON_COLUMN_TRAINER, CONTEXT(uint16_t));
+}
+
+static void
+Filters_TrainerGender(struct FilterOp* op, const void* context)
+{
+	FilterOp_InitField(op, FILTER_OP_FIELD, FILTER_STAGE_FIELD, POKEMON_BLOCK_MISC,
+		offsetof(struct Pokemon_Misc, origin), 15, 1, CONTEXT(bool));
+	FilterOp_SetColumn(op, POKEMON_COLUMN_GENDER, CONTEXT(bool));
+}
+
+struct FilterSetContext
+{
+	const struct FilterSet* keys;
+	FnCompileFilter* compile;
+};
+
+// Compiles an in or between predicate. The equality filter is compiled
+// for a zero key to locate the field, which is then tested against the
+// set instead.
+static void
+Filters_Set(struct FilterOp* op, const void* context)
+{
+	const struct FilterSetContext* set = &CONTEXT(struct FilterSetContext);
+
+	byte zero[CONTEXT_SIZE];
+	memset(zero, 0, sizeof(zero));
+
+	set->compile(op, zero);
+	FilterOp_SetKeys(op, set->keys);
+}
+
+// National dex numbers do not map to a single field value, so the set is
+// tested against the number looked up for each record.
+static void
+Filters_PokedexSet(struct FilterOp* op, const void* context)
+{
+	FilterOp_Init(op, FILTER_OP_POKEDEX, FILTER_STAGE_FIELD, 0);
+	FilterOp_SetColumn(op, POKEMON_COLUMN_POKEDEX, 0);
+	FilterOp_SetKeys(op, CONTEXT(struct FilterSetContext).keys);
+}
+
+// A masked compare of one header word, for names that span several words.
+struct FilterWordContext
+{
+	uint32_t value;
+	uint32_t mask;
+	uint8_t offset;
+};
+
+static void
+Filters_HeaderWord(struct FilterOp* op, const void* context)
+{
+	const struct FilterWordContext* word = &CONTEXT(struct FilterWordContext);
+
+	FilterOp_Init(op, FILTER_OP_HEADER, FILTER_STAGE_HEADER, word->value);
+	op->offset = word->offset;
+	op->mask = word->mask;
+}
+
+// Filters with a set compiler of NULL use Filters_Set. Keys of in and
+// between predicates are parsed as 16-bit values by parseKey.
+struct FilterInfo
+{
+	const char* name;
+	FnCompileFilter* compile;
+	FnCompileFilter* compileSet;
+	FnParseContext* parseContext;
+	FnParseContext* parseKey;
+};
+
+struct FilterInfo const GFilters[] = {
+	{ "box", Filters_Box, NULL, ParseContext_uint32, ParseContext_uint16 },
+	{ "slot", Filters_Slot, NULL, ParseContext_uint32, ParseContext_uint16 },
+	{ "pokedex", Filters_Pokedex, Filters_PokedexSet, ParseContext_uint16, ParseContext_uint16 },
+	{ "held-item", Filters_HeldItem, NULL, ParseContext_uint16, ParseContext_uint16 },
+	{ "trainer-id", Filters_Trainer, NULL, ParseContext_uint16, ParseContext_uint16 },
+	{ "trainer-gender", Filters_TrainerGender, NULL, ParseContext_Gender, ParseContext_GenderKey },
+};
+
+// Names are matched in their encoded form, without decoding any record.
+struct NameFilterInfo
+{
+	const char* name;
+	uint8_t offset;
+	uint8_t size;
+};
+
+struct NameFilterInfo const GNameFilters[] = {
+	{ "nickname", offsetof(struct Pokemon, nickname), POKEMON_NICKNAME_SIZE },
+	{ "trainer-name", offsetof(struct Pokemon, trainerName), POKEMON_OT_NAME_SIZE },
+};
+
+struct Action
+{
+	FnAction* func;
+	byte context[CONTEXT_SIZE];
+};
+
+static void
+Action_Invoke(const struct Action* action, struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc)
+{
+	action->func(pokemon, misc, &action->context);
+}
+
+static void
+Actions_Nickname(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+{
+	UNUSED(misc);
+
+	struct StringSpan name = CONTEXT(struct StringSpan);
+	String_Encode(name.data, name.size, pokemon->nickname, POKEMON_NICKNAME_SIZE);
+}
+
+static void
+Actions_TrainerName(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+{
+	UNUSED(misc);
+
+	struct StringSpan name = CONTEXT(struct StringSpan);
+	String_Encode(name.data, name.size, pokemon->trainerName, POKEMON_OT_NAME_SIZE);
+}
+
+static void
+Actions_TrainerGender(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+{
+	UNUSED(pokemon);
+
+	misc->origin.gender = CONTEXT(bool);
+}
+
+static void
+Actions_MetLocation(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+{
+	UNUSED(misc);
+
+	pokemon->data.misc.location = CONTEXT(uint8_t);
+}
+
+static void
+Actions_HeldItem(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+{
+	UNUSED(misc);
+
+	pokemon->data.growth.item = CONTEXT(uint16_t);
+}
+
+static void
+Actions_Ball(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+{
+	UNUSED(pokemon);
+
+	misc->origin.ball = CONTEXT(uint8_t);
+}
+
+struct ActionInfo
+{
+	const char* name;
+	FnAction* func;
+	FnParseContext* parseContext;
+};
+
+struct ActionInfo const GActions[] = {
+	{ "nickname", Actions_Nickname, ParseContext_StringSpan },
+	{ "trainer-name", Actions_TrainerName, ParseContext_StringSpan },
+	{ "trainer-gender", Actions_TrainerGender, ParseContext_Gender },
+	{ "met-location", Actions_MetLocation, ParseContext_uint8 },
+	{ "held-item", Actions_HeldItem, ParseContext_uint16 },
+	{ "ball", Actions_Ball, ParseContext_uint8 },
+};
+
+enum FilterNodeType
+{
+	FILTER_NODE_OP,
+	FILTER_NODE_AND,
+	FILTER_NODE_OR,
+};
+
+#define FILTER_NODE_NONE UINT8_MAX
+
+// A compiled boolean expression node. Children are linked through next
+// in order of increasing cost, so that the cheapest operand decides a
+// short-circuit first. The stage is the latest stage of any leaf.
+struct FilterNode
+{
+	uint8_t type;
+	uint8_t stage;
+	bool expect;
+	uint8_t child;
+	uint8_t next;
+	uint16_t cost;
+	struct FilterOp op;
+};
+
+// The conjunction of the plain compares in ops and of the expressions,
+// both grouped by stage. Expressions are the conjuncts containing an or
+// or a negated group.
+struct QueryPlan
+{
+	struct SlotMask slots;
+	size_t slotFirst;
+	size_t slotLast;
+
+	size_t opCount;
+	struct FilterOp ops[32];
+
+	size_t stages[FILTER_STAGE_COUNT + 1];
+
+	size_t predicateCount;
+	struct FilterOp predicates[32];
+
+	size_t nodeCount;
+	struct FilterNode nodes[64];
+
+	size_t expressionCount;
+	uint8_t expressions[32];
+
+	size_t expressionStages[FILTER_STAGE_COUNT + 1];
+};
+
+static bool
+QueryPlan_Evaluate(const struct QueryPlan* plan, size_t node, const struct Pokemon* pokemon, size_t index, bool decrypted)
+{
+	const struct FilterNode* current = &plan->nodes[node];
+
+	if (current->type == FILTER_NODE_OP)
+		return FilterOp_Execute(&current->op, pokemon, index, decrypted);
+
+	// Evaluation stops at the first operand equal to stop.
+	bool stop = current->type == FILTER_NODE_OR;
+	bool result = !stop;
+
+	for (size_t i = current->child; i != FILTER_NODE_NONE; i = plan->nodes[i].next)
+	{
+		if (QueryPlan_Evaluate(plan, i, pokemon, index, decrypted) == stop)
+		{
+			result = stop;
+			break;
+		}
+	}
+
+	return result == current->expect;
+}
+
+static bool
+QueryPlan_FilterExpressions(const struct QueryPlan* plan, enum FilterStage stage, const struct Pokemon* pokemon, size_t index, bool decrypted)
+{
+	for (size_t i = plan->expressionStages[stage], c = plan->expressionStages[stage + 1]; i < c; ++i)
+		if (!QueryPlan_Evaluate(plan, plan->expressions[i], pokemon, index, decrypted))
+			return false;
+	return true;
+}
+
+static bool
+QueryPlan_Filter(const struct QueryPlan* plan, enum FilterStage stage, const struct Pokemon* pokemon, size_t index, bool decrypted)
+{
+	for (size_t i = plan->stages[stage], c = plan->stages[stage + 1]; i < c; ++i)
+		if (!FilterOp_Execute(&plan->ops[i], pokemon, index, decrypted))
+			return false;
+	return QueryPlan_FilterExpressions(plan, stage, pokemon, index, decrypted);
+}
+
+// The columnar scan tests ops with a column on the column values. Only
+// the other ops and the expressions are tested on the records.
+static bool
+QueryPlan_FilterUncovered(const struct QueryPlan* plan, enum FilterStage stage, const struct Pokemon* pokemon, size_t index, bool decrypted)
+{
+	for (size_t i = plan->stages[stage], c = plan->stages[stage + 1]; i < c; ++i)
+		if (plan->ops[i].column == POKEMON_COLUMN_NONE && !FilterOp_Execute(&plan->ops[i], pokemon, index, decrypted))
+			return false;
+	return QueryPlan_FilterExpressions(plan, stage, pokemon, index, decrypted);
+}
+
+static bool
+QueryPlan_HasStage(const struct QueryPlan* plan, enum FilterStage stage)
+{
+	return plan->stages[stage] != plan->stages[stage + 1]
+		|| plan->expressionStages[stage] != plan->expressionStages[stage + 1];
+}
+
+// Folds a positive compare into an existing one reading the same word.
+// Returns false if the two can never hold at once.
+static bool
+QueryPlan_Fold(struct QueryPlan* plan, const struct FilterOp* op, bool* folded)
+{
+	*folded = false;
+
+	if (!op->expect || op->code == FILTER_OP_FALSE || op->set != NULL)
+		return true;
+
+	for (size_t i = 0; i < plan->opCount; ++i)
+	{
+		struct FilterOp* other = &plan->ops[i];
+
+		if (!other->expect || other->set != NULL || other->code != op->code || other->block != op->block || other->offset != op->offset)
+			continue;
+
+		uint32_t common = other->mask & op->mask;
+		if ((other->value & common) != (op->value & common))
+			return false;
+
+		other->mask |= op->mask;
+		other->value |= op->value;
+		*folded = true;
+		break;
+	}
+	return true;
+}
+
+// A node of a parsed where expression, of a FilterNodeType. Leaves name
+// a filter. Children are linked through next.
+struct FilterTerm
+{
+	uint8_t type;
+	bool expect;
+	uint8_t filter;
+	uint8_t child;
+	uint8_t last;
+	uint8_t next;
+};
+
+enum
+{
+	OWNER_NAME = 1 << 0,
+	OWNER_ID = 1 << 1,
+	OWNER_GENDER = 1 << 2,
+};
+
+// Predicates on the player who owns the save. Files whose owner does not
+// match are skipped before their storage is read.
+struct OwnerQuery
+{
+	uint32_t fields;
+	uint8_t nameLength;
+	byte name[POKEMON_OT_NAME_SIZE];
+	uint16_t id;
+	bool gender;
+};
+
+static bool
+OwnerQuery_Match(const struct OwnerQuery* query, const struct Trainer* trainer)
+{
+	if ((query->fields & OWNER_NAME) && memcmp(trainer->name, query->name, query->nameLength) != 0)
+		return false;
+
+	if ((query->fields & OWNER_ID) && trainer->trainerPublic != query->id)
+		return false;
+
+	if ((query->fields & OWNER_GENDER) && (trainer->gender != 0) != query->gender)
+		return false;
+
+	return true;
+}
+
+struct ProgramArguments
+{
+	size_t fileCount;
+	size_t fileCapacity;
+	char** files;
+
+	size_t threadCount;
+	uint32_t verify;
+	uint32_t scan;
+	const char* cache;
+	const struct FormatInfo* format;
+	struct Projection projection;
+	struct AggregateQuery aggregate;
+	struct OrderQuery order;
+	uint32_t limit;
+	bool exists;
+	struct OwnerQuery owner;
+
+	// Standard input can be read once, by the manifest pattern or by a
+	// script named "-". The server never reads its own.
+	bool input;
+
+	size_t filterCount;
+	struct Filter filters[32];
+
+	// Parsed where expressions. Term 0 is the conjunction of all of them.
+	size_t termCount;
+	struct FilterTerm terms[64];
+
+	size_t setCount;
+	struct FilterSet* sets[32];
+
+	size_t actionCount;
+	struct Action actions[32];
+
+	// Text of the script until it is parsed into statements. Each statement
+	// has its own filters and actions.
+	struct Buffer script;
+	size_t statementCount;
+	struct ProgramArguments* statements;
+
+	struct QueryPlan plan;
+};
+
+// Returns the number of arguments consumed, or COMMAND_ERROR.
+typedef size_t FnParseCommand(struct ProgramArguments* arguments, size_t argc, const char** argv);
+
+#define COMMAND_ERROR ((size_t)-1)
+
+struct CommandInfo
+{
+	const char* name;
+	FnParseCommand* parse;
+};
+
+// Adds the keys of a list such as "(1, 2, 3)", or of a file named by
+// "@path" holding keys separated by commas or whitespace.
+static bool
+FilterSet_ParseList(struct FilterSet* set, FnParseContext* parseKey, const char* list)
+{
+	struct Buffer file;
+	Buffer_Init(&file);
+
+	struct StringSpan text = StringSpan_FromCString(list);
+
+	if (list[0] == '@')
+	{
+		FILE* stream = fopen(list + 1, "rb");
+		if (stream == NULL)
+			return false;
+
+		bool result = Buffer_ReadStream(&file, stream);
+		fclose(stream);
+
+		if (!result)
+		{
+			Buffer_Destroy(&file);
+			return false;
+		}
+
+		text = StringSpan_Create(file.data, file.size);
+	}
+	else if (text.size >= 2 && text.data[0] == '(' && text.data[text.size - 1] == ')')
+		text = StringSpan_Substring(text, 1, text.size - 2);
+
+	const struct StringSpan separators = StringSpan_FromCString(", \t\r\n");
+
+	bool result = true;
+	size_t count = 0;
+
+	while (result && text.size != 0)
+	{
+		size_t length = StringSpan_FindAnyChar(text, separators);
+		if (length == (size_t)-1)
+			length = text.size;
+
+		if (length != 0)
+		{
+			uint16_t key;
+			result = parseKey(&key, StringSpan_Substring(text, 0, length));
+
+			if (result)
+			{
+				FilterSet_Add(set, key);
+				++count;
+			}
+		}
+
+		StringSpan_RemovePrefix(&text, length);
+		if (text.size != 0)
+			StringSpan_RemovePrefix(&text, 1);
+	}
+
+	Buffer_Destroy(&file);
+	return result && count != 0;
+}
+
+static bool
+FilterSet_ParseRange(struct FilterSet* set, FnParseContext* parseKey, const char* first, const char* last)
+{
+	uint16_t lo, hi;
+	if (!parseKey(&lo, StringSpan_FromCString(first)) || !parseKey(&hi, StringSpan_FromCString(last)) || lo > hi)
+		return false;
+
+	for (uint32_t key = lo; key <= hi; ++key)
+		FilterSet_Add(set, key);
+	return true;
+}
+
+static struct FilterSet*
+ProgramArguments_AddSet(struct ProgramArguments* arguments)
+{
+	if (arguments->setCount == ARRAY_SIZE(arguments->sets))
+		return NULL;
+
+	struct FilterSet* set = (struct FilterSet*)calloc(1, sizeof(struct FilterSet));
+	if (set != NULL)
+		arguments->sets[arguments->setCount++] = set;
+	return set;
+}
+
+static size_t
+ProgramArguments_AddTerm(struct ProgramArguments* arguments, enum FilterNodeType type)
+{
+	if (arguments->termCount == ARRAY_SIZE(arguments->terms))
+		return FILTER_NODE_NONE;
+
+	size_t index = arguments->termCount++;
+	struct FilterTerm* term = &arguments->terms[index];
+	term->type = (uint8_t)type;
+	term->expect = true;
+	term->filter = 0;
+	term->child = FILTER_NODE_NONE;
+	term->last = FILTER_NODE_NONE;
+	term->next = FILTER_NODE_NONE;
+	return index;
+}
+
+static void
+ProgramArguments_AppendTerm(struct ProgramArguments* arguments, size_t parent, size_t child)
+{
+	struct FilterTerm* term = &arguments->terms[parent];
+
+	if (term->last != FILTER_NODE_NONE)
+		arguments->terms[term->last].next = (uint8_t)child;
+	else term->child = (uint8_t)child;
+
+	term->last = (uint8_t)child;
+}
+
+static size_t
+ProgramArguments_AddFilterTerm(struct ProgramArguments* arguments, size_t filter)
+{
+	size_t term = ProgramArguments_AddTerm(arguments, FILTER_NODE_OP);
+	if (term != FILTER_NODE_NONE)
+		arguments->terms[term].filter = (uint8_t)filter;
+	return term;
+}
+
+// Adds a conjunction of header word compares matching the encoded name,
+// through its terminator unless matching a prefix, and returns its term.
+// Names that do not encode whole into the field are rejected.
+static size_t
+ProgramArguments_AddNameTerm(struct ProgramArguments* arguments, const struct NameFilterInfo* info, struct StringSpan text, bool prefix)
+{
+	byte name[16];
+	size_t length = String_EncodeName(text, name, info->size);
+
+	if (length == (size_t)-1)
+		return FILTER_NODE_NONE;
+
+	if (!prefix && length < info->size)
+		++length;
+
+	size_t group = ProgramArguments_AddTerm(arguments, FILTER_NODE_AND);
+
+	for (size_t i = 0; group != FILTER_NODE_NONE && i < length;)
+	{
+		size_t index = arguments->filterCount;
+		if (index == ARRAY_SIZE(arguments->filters))
+			return FILTER_NODE_NONE;
+		struct Filter* filter = &arguments->filters[index];
+		++arguments->filterCount;
+
+		struct FilterWordContext word;
+		word.offset = (uint8_t)((info->offset + i) & ~(size_t)3);
+		word.value = 0;
+		word.mask = 0;
+
+		for (; i < length && info->offset + i < word.offset + 4u; ++i)
+		{
+			size_t shift = (info->offset + i - word.offset) * 8;
+			word.value |= (uint32_t)name[i] << shift;
+			word.mask |= (uint32_t)0xFF << shift;
+		}
+
+		void* context = filter->context;
+		CONTEXT_SET(struct FilterWordContext) = word;
+		filter->compile = Filters_HeaderWord;
+
+		size_t term = ProgramArguments_AddFilterTerm(arguments, index);
+		if (term == FILTER_NODE_NONE)
+			return FILTER_NODE_NONE;
+
+		ProgramArguments_AppendTerm(arguments, group, term);
+	}
+	return group;
+}
+
+// <filter> <value>
+// <filter> in <list>
+// <filter> between <first> <last>
+// <name filter> <name>
+// <name filter> prefix <name>
+static size_t
+ProgramArguments_ParsePredicate(struct ProgramArguments* arguments, size_t argc, const char** argv, size_t* term)
+{
+	if (argc < 2)
+		return COMMAND_ERROR;
+
+	const char* key = argv[0];
+	for (size_t i = 0, c = ARRAY_SIZE(GNameFilters); i < c; ++i)
+	{
+		const struct NameFilterInfo* info = &GNameFilters[i];
+
+		if (strcmp(info->name, key) == 0)
+		{
+			bool prefix = strcmp(argv[1], "prefix") == 0;
+			if (prefix && argc < 3)
+				return COMMAND_ERROR;
+
+			*term = ProgramArguments_AddNameTerm(arguments, info, StringSpan_FromCString(argv[prefix ? 2 : 1]), prefix);
+			if (*term == FILTER_NODE_NONE)
+				return COMMAND_ERROR;
+			return prefix ? 3 : 2;
+		}
+	}
+
+	for (size_t i = 0, c = ARRAY_SIZE(GFilters); i < c; ++i)
+	{
+		const struct FilterInfo* info = &GFilters[i];
+
+		if (strcmp(info->name, key) == 0)
+		{
+			size_t index = arguments->filterCount;
+			if (index == ARRAY_SIZE(arguments->filters))
+				return COMMAND_ERROR;
+			struct Filter* filter = &arguments->filters[index];
+			++arguments->filterCount;
+
+			*term = ProgramArguments_AddFilterTerm(arguments, index);
+			if (*term == FILTER_NODE_NONE)
+				return COMMAND_ERROR;
+
+			bool range = strcmp(argv[1], "between") == 0;
+			if (range || strcmp(argv[1], "in") == 0)
+			{
+				size_t size = range ? 4 : 3;
+				if (argc < size)
+					return COMMAND_ERROR;
+
+				struct FilterSet* keys = ProgramArguments_AddSet(arguments);
+				if (keys == NULL)
+					return COMMAND_ERROR;
+
+				bool parsed = range
+					? FilterSet_ParseRange(keys, info->parseKey, argv[2], argv[3])
+					: FilterSet_ParseList(keys, info->parseKey, argv[2]);
+
+				if (!parsed)
+					return COMMAND_ERROR;
+
+				struct FilterSetContext set;
+				set.keys = keys;
+				set.compile = info->compile;
+
+				void* context = filter->context;
+				CONTEXT_SET(struct FilterSetContext) = set;
+
+				filter->compile = info->compileSet != NULL ? info->compileSet : Filters_Set;
+				return size;
+			}
+
+			const struct StringSpan val = StringSpan_FromCString(argv[1]);
+			if (!info->parseContext(&filter->context, val))
+				return COMMAND_ERROR;
+			filter->compile = info->compile;
+			return 2;
+		}
+	}
+
+	return COMMAND_ERROR;
+}
+
+// Recursive descent over the arguments of a where command:
+//   or    := and { "or" and }
+//   and   := unary { "and" unary }
+//   unary := "not" unary | "(" or ")" | predicate
+// Each function returns the index of the parsed term or FILTER_NODE_NONE.
+struct FilterParser
+{
+	struct ProgramArguments* arguments;
+	size_t argc;
+	const char** argv;
+	size_t position;
+};
+
+static bool
+FilterParser_Accept(struct FilterParser* parser, const char* token)
+{
+	if (parser->position == parser->argc || strcmp(parser->argv[parser->position], token) != 0)
+		return false;
+
+	++parser->position;
+	return true;
+}
+
+static size_t
+FilterParser_ParseOr(struct FilterParser* parser);
+
+static size_t
+FilterParser_ParseUnary(struct FilterParser* parser)
+{
+	struct ProgramArguments* arguments = parser->arguments;
+
+	if (FilterParser_Accept(parser, "not"))
+	{
+		size_t term = FilterParser_ParseUnary(parser);
+		if (term != FILTER_NODE_NONE)
+			arguments->terms[term].expect = !arguments->terms[term].expect;
+		return term;
+	}
+
+	if (FilterParser_Accept(parser, "("))
+	{
+		size_t term = FilterParser_ParseOr(parser);
+		if (term == FILTER_NODE_NONE || !FilterParser_Accept(parser, ")"))
+			return FILTER_NODE_NONE;
+		return term;
+	}
+
+	size_t term;
+	size_t count = ProgramArguments_ParsePredicate(arguments,
+		parser->argc - parser->position, parser->argv + parser->position, &term);
+
+	if (count == COMMAND_ERROR)
+		return FILTER_NODE_NONE;
+
+	parser->position += count;
+	return term;
+}
+
+static size_t
+FilterParser_ParseGroup(struct FilterParser* parser, enum FilterNodeType type, const char* keyword, size_t (*parse)(struct FilterParser*))
+{
+	size_t term = parse(parser);
+	size_t group = FILTER_NODE_NONE;
+
+	while (term != FILTER_NODE_NONE && FilterParser_Accept(parser, keyword))
+	{
+		if (group == FILTER_NODE_NONE)
+		{
+			group = ProgramArguments_AddTerm(parser->arguments, type);
+			if (group == FILTER_NODE_NONE)
+				return FILTER_NODE_NONE;
+
+			ProgramArguments_AppendTerm(parser->arguments, group, term);
+		}
+
+		term = parse(parser);
+		if (term != FILTER_NODE_NONE)
+			ProgramArguments_AppendTerm(parser->arguments, group, term);
+	}
+
+	if (term == FILTER_NODE_NONE)
+		return FILTER_NODE_NONE;
+
+	return group != FILTER_NODE_NONE ? group : term;
+}
+
+static size_t
+FilterParser_ParseAnd(struct FilterParser* parser)
+{
+	return FilterParser_ParseGroup(parser, FILTER_NODE_AND, "and", FilterParser_ParseUnary);
+}
+
+static size_t
+FilterParser_ParseOr(struct FilterParser* parser)
+{
+	return FilterParser_ParseGroup(parser, FILTER_NODE_OR, "or", FilterParser_ParseAnd);
+}
+
+// where <expression>
+static size_t
+Commands_Where(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	struct FilterParser parser;
+	parser.arguments = arguments;
+	parser.argc = argc;
+	parser.argv = argv;
+	parser.position = 0;
+
+	size_t term = FilterParser_ParseOr(&parser);
+	if (term == FILTER_NODE_NONE)
+		return COMMAND_ERROR;
+
+	ProgramArguments_AppendTerm(arguments, 0, term);
+	return parser.position;
+}
+
+static size_t
+Commands_Set(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	if (argc < 2)
+		return COMMAND_ERROR;
+
+	const char* key = argv[0];
+	for (size_t i = 0, c = ARRAY_SIZE(GActions); i < c; ++i)
+	{
+		const struct ActionInfo* info = &GActions[i];
+
+		if (strcmp(info->name, key) == 0)
+		{
+			size_t index = arguments->actionCount;
+			if (index == ARRAY_SIZE(arguments->actions))
+				return COMMAND_ERROR;
+			struct Action* action = &arguments->actions[index];
+			++arguments->actionCount;
+
+			const struct StringSpan val = StringSpan_FromCString(argv[1]);
+			if (!info->parseContext(&action->context, val))
+				return COMMAND_ERROR;
+			action->func = info->func;
+			return 2;
+		}
+	}
+
+	return COMMAND_ERROR;
+}
+
+static size_t
+Commands_Threads(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	if (argc < 1)
+		return COMMAND_ERROR;
+
+	uint32_t count;
+	if (!ParseUInt32(StringSpan_FromCString(argv[0]), 10, 1024, &count) || count == 0)
+		return COMMAND_ERROR;
+
+	arguments->threadCount = count;
+	return 1;
+}
+
+enum
+{
+	VERIFY_POKEMON = 1 << 0,
+	VERIFY_SECTIONS = 1 << 1,
+};
+
+struct VerifyInfo
+{
+	const char* name;
+	uint32_t flags;
+};
+
+static const struct VerifyInfo GVerify[] = {
+	{ "pokemon", VERIFY_POKEMON },
+	{ "sections", VERIFY_SECTIONS },
+};
+
+static size_t
+Commands_Verify(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	if (argc < 1)
+		return COMMAND_ERROR;
+
+	for (size_t i = 0, c = ARRAY_SIZE(GVerify); i < c; ++i)
+	{
+		if (strcmp(GVerify[i].name, argv[0]) == 0)
+		{
+			arguments->verify |= GVerify[i].flags;
+			return 1;
+		}
+	}
+
+	return COMMAND_ERROR;
+}
+
+enum
+{
+	SCAN_ROWS,
+	SCAN_COLUMNS,
+};
+
+struct ScanInfo
+{
+	const char* name;
+	uint32_t mode;
+};
+
+static const struct ScanInfo GScan[] = {
+	{ "rows", SCAN_ROWS },
+	{ "columns", SCAN_COLUMNS },
+};
+
+static size_t
+Commands_Scan(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	if (argc < 1)
+		return COMMAND_ERROR;
+
+	for (size_t i = 0, c = ARRAY_SIZE(GScan); i < c; ++i)
+	{
+		if (strcmp(GScan[i].name, argv[0]) == 0)
+		{
+			arguments->scan = GScan[i].mode;
+			return 1;
+		}
+	}
+
+	return COMMAND_ERROR;
+}
+
+static size_t
+Commands_Cache(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	if (argc < 1)
+		return COMMAND_ERROR;
+
+	arguments->cache = argv[0];
+	return 1;
+}
+
+static size_t
+Commands_Format(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	if (argc < 1)
+		return COMMAND_ERROR;
+
+	for (size_t i = 0, c = ARRAY_SIZE(GFormats); i < c; ++i)
+	{
+		if (strcmp(GFormats[i].name, argv[0]) == 0)
+		{
+			arguments->format = &GFormats[i];
+			return 1;
+		}
+	}
+
+	return COMMAND_ERROR;
+}
+
+static size_t
+Commands_Select(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	struct Projection* projection = &arguments->projection;
+	projection->selected = true;
+
+	// Names are taken up to the first one that is neither a field nor a
+	// group, which is left for the next command.
+	size_t i = 0;
+	for (; i < argc; ++i)
+		if (!Projection_AddName(projection, StringSpan_FromCString(argv[i])))
+			break;
+
+	return i != 0 ? i : COMMAND_ERROR;
+}
+
+static size_t
+Commands_Count(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	UNUSED(argc, argv);
+
+	arguments->aggregate.enabled = true;
+	return 0;
+}
+
+static size_t
+Commands_Group(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	if (argc < 2 || strcmp(argv[0], "by") != 0)
+		return COMMAND_ERROR;
+
+	const struct FieldInfo* field = FieldInfo_Find(StringSpan_FromCString(argv[1]));
+	if (field == NULL || field->type == FIELD_TYPE_STRING)
+		return COMMAND_ERROR;
+
+	arguments->aggregate.enabled = true;
+	arguments->aggregate.group = field;
+	return 2;
+}
+
+static size_t
+Commands_Aggregate(struct ProgramArguments* arguments, size_t argc, const char** argv, uint8_t op)
+{
+	struct AggregateQuery* query = &arguments->aggregate;
+
+	if (argc < 1 || query->columnCount == AGGREGATE_COLUMN_CAPACITY)
+		return COMMAND_ERROR;
+
+	const struct FieldInfo* field = FieldInfo_Find(StringSpan_FromCString(argv[0]));
+	if (field == NULL || field->type == FIELD_TYPE_STRING)
+		return COMMAND_ERROR;
+
+	struct AggregateColumn* column = &query->columns[query->columnCount++];
+	column->op = op;
+	column->field = field;
+
+	query->enabled = true;
+	return 1;
+}
+
+static size_t
+Commands_Min(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	return Commands_Aggregate(arguments, argc, argv, AGGREGATE_MIN);
+}
+
+static size_t
+Commands_Max(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	return Commands_Aggregate(arguments, argc, argv, AGGREGATE_MAX);
+}
+
+static size_t
+Commands_Sum(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	return Commands_Aggregate(arguments, argc, argv, AGGREGATE_SUM);
+}
+
+static size_t
+Commands_Order(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	if (argc < 2 || strcmp(argv[0], "by") != 0)
+		return COMMAND_ERROR;
+
+	const struct FieldInfo* field = FieldInfo_Find(StringSpan_FromCString(argv[1]));
+	if (field == NULL || field->type == FIELD_TYPE_STRING)
+		return COMMAND_ERROR;
+
+	arguments->order.field = field;
+	arguments->order.descending = false;
+
+	if (argc > 2 && strcmp(argv[2], "asc") == 0)
+		return 3;
+
+	if (argc > 2 && strcmp(argv[2], "desc") == 0)
+	{
+		arguments->order.descending = true;
+		return 3;
+	}
+
+	return 2;
+}
+
+static size_t
+Commands_Limit(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	if (argc < 1)
+		return COMMAND_ERROR;
+
+	uint32_t limit;
+	if (!ParseUInt32(StringSpan_FromCString(argv[0]), 10, 1 << 20, &limit) || limit == 0)
+		return COMMAND_ERROR;
+
+	arguments->limit = limit;
+	return 1;
+}
+
+static size_t
+Commands_First(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	UNUSED(argc, argv);
+
+	arguments->limit = 1;
+	return 0;
+}
+
+static size_t
+Commands_Exists(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	UNUSED(argc, argv);
+
+	arguments->limit = 1;
+	arguments->exists = true;
+	return 0;
+}
+
+// owner name <name>
+// owner id <id>
+// owner gender <m|f>
+static size_t
+Commands_Owner(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	if (argc < 2)
+		return COMMAND_ERROR;
+
+	struct OwnerQuery* owner = &arguments->owner;
+	const struct StringSpan value = StringSpan_FromCString(argv[1]);
+
+	if (strcmp(argv[0], "name") == 0)
+	{
+		size_t length = String_EncodeName(value, owner->name, sizeof(owner->name));
+		if (length == (size_t)-1)
+			return COMMAND_ERROR;
+
+		// The name matches through its terminator.
+		if (length < sizeof(owner->name))
+			++length;
+
+		owner->nameLength = (uint8_t)length;
+		owner->fields |= OWNER_NAME;
+	}
+	else if (strcmp(argv[0], "id") == 0)
+	{
+		if (!ParseContext_uint16(&owner->id, value))
+			return COMMAND_ERROR;
+		owner->fields |= OWNER_ID;
+	}
+	else if (strcmp(argv[0], "gender") == 0)
+	{
+		if (!ParseContext_Gender(&owner->gender, value))
+			return COMMAND_ERROR;
+		owner->fields |= OWNER_GENDER;
+	}
+	else return COMMAND_ERROR;
+
+	return 2;
+}
+
+// script <path|->
+static size_t
+Commands_Script(struct ProgramArguments* arguments, size_t argc, const char** argv)
+{
+	if (argc < 1 || arguments->script.data != NULL)
+		return COMMAND_ERROR;
+
+	if (strcmp(argv[0], "-") == 0)
+	{
+		if (!arguments->input)
+			return COMMAND_ERROR;
+
+		arguments->input = false;
+		return Buffer_ReadStream(&arguments->script, stdin) ? 1 : COMMAND_ERROR;
+	}
+
+	FILE* stream = fopen(argv[0], "rb");
+	if (stream == NULL)
+		return COMMAND_ERROR;
+
+	bool result = Buffer_ReadStream(&arguments->script, stream);
+	fclose(stream);
+
+	return result ? 1 : COMMAND_ERROR;
+}
+
+static const struct CommandInfo GCommands[] = {
+	{ "where", Commands_Where },
+	{ "set", Commands_Set },
+	{ "threads", Commands_Threads },
+	{ "verify", Commands_Verify },
+	{ "scan", Commands_Scan },
+	{ "cache", Commands_Cache },
+	{ "format", Commands_Format },
+	{ "select", Commands_Select },
+	{ "count", Commands_Count },
+	{ "group", Commands_Group },
+	{ "min", Commands_Min },
+	{ "max", Commands_Max },
+	{ "sum", Commands_Sum },
+	{ "order", Commands_Order },
+	{ "limit", Commands_Limit },
+	{ "first", Commands_First },
+	{ "exists", Commands_Exists },
+	{ "script", Commands_Script },
+	{ "owner", Commands_Owner },
+};
+
+static const struct CommandInfo*
+CommandInfo_Find(const char* name)
+{
+	for (size_t i = 0, c = ARRAY_SIZE(GCommands); i < c; ++i)
+		if (strcmp(GCommands[i].name, name) == 0)
+			return &GCommands[i];
+	return NULL;
+}
+
+static bool
+ProgramArguments_AddFile(struct ProgramArguments* arguments, const char* file, size_t length)
+{
+	if (arguments->fileCount == arguments->fileCapacity)
+	{
+		size_t capacity = arguments->fileCapacity != 0 ? arguments->fileCapacity * 2 : 16;
+		char** files = (char**)realloc(arguments->files, capacity * sizeof(char*));
+		if (files == NULL)
+			return false;
+		arguments->files = files;
+		arguments->fileCapacity = capacity;
+	}
+
+	char* copy = String_Duplicate(file, length);
+	if (copy == NULL)
+		return false;
+
+	arguments->files[arguments->fileCount++] = copy;
+	return true;
+}
+
+static bool
+ProgramArguments_AddManifest(struct ProgramArguments* arguments, FILE* stream)
+{
+	struct Buffer text;
+	Buffer_Init(&text);
+
+	bool result = Buffer_ReadStream(&text, stream);
+
+	struct StringSpan span = StringSpan_Create(text.data, text.size);
+	const struct StringSpan newline = StringSpan_FromCString("\r\n");
+
+	while (result && span.size != 0)
+	{
+		size_t length = StringSpan_FindAnyChar(span, newline);
+		if (length == (size_t)-1)
+			length = span.size;
+
+		if (length != 0)
+			result = ProgramArguments_AddFile(arguments, span.data, length);
+
+		StringSpan_RemovePrefix(&span, length);
+		if (span.size != 0)
+			StringSpan_RemovePrefix(&span, 1);
+	}
+
+	Buffer_Destroy(&text);
+	return result;
+}
+
+static bool
+ProgramArguments_AddPattern(struct ProgramArguments* arguments, const char* pattern)
+{
+	if (strcmp(pattern, "-") == 0)
+	{
+		if (!arguments->input)
+			return false;
+
+		arguments->input = false;
+		return ProgramArguments_AddManifest(arguments, stdin);
+	}
+
+	struct StringSpan span = StringSpan_FromCString(pattern);
+	if (StringSpan_FindAnyChar(span, StringSpan_FromCString("*?[")) == (size_t)-1)
+		return ProgramArguments_AddFile(arguments, span.data, span.size);
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA data;
+	HANDLE find = FindFirstFileA(pattern, &data);
+
+	if (find == INVALID_HANDLE_VALUE)
+		return ProgramArguments_AddFile(arguments, span.data, span.size);
+
+	size_t directory = span.size;
+	while (directory != 0 && StringSpan_FindChar(StringSpan_FromCString("/\\:"), pattern[directory - 1]) == (size_t)-1)
+		--directory;
+
+	struct Buffer path;
+	Buffer_Init(&path);
+
+	bool result = true;
+	do {
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+
+		path.size = 0;
+		result = Buffer_Append(&path, pattern, directory)
+			&& Buffer_Append(&path, data.cFileName, strlen(data.cFileName))
+			&& ProgramArguments_AddFile(arguments, path.data, path.size);
+	} while (result && FindNextFileA(find, &data));
+
+	Buffer_Destroy(&path);
+	FindClose(find);
+	return result;
+#else
+	glob_t paths;
+	if (glob(pattern, GLOB_NOCHECK, NULL, &paths) != 0)
+		return false;
+
+	bool result = true;
+	for (size_t i = 0; result && i < paths.gl_pathc; ++i)
+		result = ProgramArguments_AddFile(arguments, paths.gl_pathv[i], strlen(paths.gl_pathv[i]));
+
+	globfree(&paths);
+	return result;
+#endif
+}
+
+static void
+ProgramArguments_Destroy(struct ProgramArguments* arguments)
+{
+	for (size_t i = 0; i < arguments->fileCount; ++i)
+		free(arguments->files[i]);
+	free(arguments->files);
+
+	for (size_t i = 0; i < arguments->setCount; ++i)
+		free(arguments->sets[i]);
+
+	for (size_t i = 0; i < arguments->statementCount; ++i)
+		ProgramArguments_Destroy(&arguments->statements[i]);
+	free(arguments->statements);
+
+	Buffer_Destroy(&arguments->script);
+}
+
+// Compiles an expression term into plan nodes and returns its node.
+static size_t
+QueryPlan_Compile(struct QueryPlan* plan, const struct ProgramArguments* arguments, size_t term)
+{
+	const struct FilterTerm* source = &arguments->terms[term];
+
+	size_t index = plan->nodeCount++;
+	struct FilterNode* node = &plan->nodes[index];
+	node->type = source->type;
+	node->expect = source->expect;
+	node->child = FILTER_NODE_NONE;
+	node->next = FILTER_NODE_NONE;
+
+	if (source->type == FILTER_NODE_OP)
+	{
+		const struct Filter* filter = &arguments->filters[source->filter];
+		filter->compile(&node->op, &filter->context);
+		node->op.expect = source->expect;
+		node->stage = node->op.stage;
+		node->cost = FilterOp_GetCost(&node->op);
+		return index;
+	}
+
+	node->stage = FILTER_STAGE_INDEX;
+	node->cost = 0;
+
+	for (size_t i = source->child; i != FILTER_NODE_NONE; i = arguments->terms[i].next)
+	{
+		size_t child = QueryPlan_Compile(plan, arguments, i);
+		struct FilterNode* compiled = &plan->nodes[child];
+
+		if (compiled->stage > node->stage)
+			node->stage = compiled->stage;
+		node->cost += compiled->cost;
+
+		uint8_t* link = &node->child;
+		while (*link != FILTER_NODE_NONE && plan->nodes[*link].cost <= compiled->cost)
+			link = &plan->nodes[*link].next;
+
+		compiled->next = *link;
+		*link = (uint8_t)child;
+	}
+	return index;
+}
+
+// Adds the conjuncts of a term to the plan. Plain compares are folded
+// into the ops, anything else becomes an expression.
+static void
+ProgramArguments_PlanTerm(struct ProgramArguments* arguments, size_t term, bool* satisfiable)
+{
+	struct QueryPlan* plan = &arguments->plan;
+	const struct FilterTerm* source = &arguments->terms[term];
+
+	if (source->type == FILTER_NODE_AND && source->expect)
+	{
+		for (size_t i = source->child; i != FILTER_NODE_NONE; i = arguments->terms[i].next)
+			ProgramArguments_PlanTerm(arguments, i, satisfiable);
+		return;
+	}
+
+	if (source->type != FILTER_NODE_OP)
+	{
+		plan->expressions[plan->expressionCount++] = (uint8_t)QueryPlan_Compile(plan, arguments, term);
+		return;
+	}
+
+	const struct Filter* filter = &arguments->filters[source->filter];
+
+	struct FilterOp op;
+	filter->compile(&op, &filter->context);
+	op.expect = source->expect;
+
+	if (op.code == FILTER_OP_FALSE)
+	{
+		*satisfiable &= !op.expect;
+		return;
+	}
+
+	if (op.column != POKEMON_COLUMN_NONE)
+		plan->predicates[plan->predicateCount++] = op;
+
+	bool folded;
+	*satisfiable &= QueryPlan_Fold(plan, &op, &folded);
+
+	if (!folded)
+		plan->ops[plan->opCount++] = op;
+}
+
+static void
+ProgramArguments_Plan(struct ProgramArguments* arguments)
+{
+	struct QueryPlan* plan = &arguments->plan;
+
+	bool satisfiable = true;
+	plan->opCount = 0;
+	plan->predicateCount = 0;
+	plan->nodeCount = 0;
+	plan->expressionCount = 0;
+
+	ProgramArguments_PlanTerm(arguments, 0, &satisfiable);
+
+	struct FilterOp ops[ARRAY_SIZE(plan->ops)];
+	size_t count = 0;
+
+	for (size_t stage = 0; stage < FILTER_STAGE_COUNT; ++stage)
+	{
+		plan->stages[stage] = count;
+		for (size_t i = 0, c = plan->opCount; i < c; ++i)
+			if (plan->ops[i].stage == stage)
+				ops[count++] = plan->ops[i];
+	}
+	plan->stages[FILTER_STAGE_COUNT] = count;
+
+	memcpy(plan->ops, ops, count * sizeof(struct FilterOp));
+
+	// Expressions of a stage run cheapest first.
+	uint8_t expressions[ARRAY_SIZE(plan->expressions)];
+	count = 0;
+
+	for (size_t stage = 0; stage < FILTER_STAGE_COUNT; ++stage)
+	{
+		plan->expressionStages[stage] = count;
+		for (size_t i = 0, c = plan->expressionCount; i < c; ++i)
+		{
+			uint8_t node = plan->expressions[i];
+			if (plan->nodes[node].stage != stage)
+				continue;
+
+			size_t j = count++;
+			for (; j > plan->expressionStages[stage] && plan->nodes[expressions[j - 1]].cost > plan->nodes[node].cost; --j)
+				expressions[j] = expressions[j - 1];
+			expressions[j] = node;
+		}
+	}
+	plan->expressionStages[FILTER_STAGE_COUNT] = count;
+
+	memcpy(plan->expressions, expressions, count);
+
+	SlotMask_Clear(&plan->slots);
+	plan->slotFirst = 0;
+	plan->slotLast = 0;
+
+	for (size_t i = 0; satisfiable && i < STORAGE_POKEMON_COUNT; ++i)
+	{
+		if (!QueryPlan_Filter(plan, FILTER_STAGE_INDEX, NULL, i, false))
+			continue;
+
+		if (plan->slotLast == 0)
+			plan->slotFirst = i;
+		plan->slotLast = i + 1;
+
+		SlotMask_Set(&plan->slots, i);
+	}
+}
+
+static bool
+ProgramArguments_IsMutating(const struct ProgramArguments* arguments)
+{
+	return arguments->actionCount > 0 || arguments->statementCount > 0;
+}
+
+static void
+ProgramArguments_Init(struct ProgramArguments* arguments)
+{
+	arguments->fileCount = 0;
+	arguments->fileCapacity = 0;
+	arguments->files = NULL;
+	arguments->threadCount = 0;
+	arguments->verify = 0;
+	arguments->scan = SCAN_ROWS;
+	arguments->cache = NULL;
+	arguments->format = &GFormats[0];
+	arguments->projection.fieldCount = 0;
+	arguments->projection.selected = false;
+	arguments->projection.decode = 0;
+	arguments->aggregate.enabled = false;
+	arguments->aggregate.group = NULL;
+	arguments->aggregate.columnCount = 0;
+	arguments->order.field = NULL;
+	arguments->order.descending = false;
+	arguments->limit = 0;
+	arguments->exists = false;
+	arguments->owner.fields = 0;
+	arguments->input = false;
+	arguments->filterCount = 0;
+	arguments->termCount = 0;
+	ProgramArguments_AddTerm(arguments, FILTER_NODE_AND);
+	arguments->setCount = 0;
+	arguments->actionCount = 0;
+	Buffer_Init(&arguments->script);
+	arguments->statementCount = 0;
+	arguments->statements = NULL;
+}
+
+// Splits a line into words separated by whitespace. Double quotes
+// group words containing spaces. The line is modified in place.
+static size_t
+String_Tokenize(char* line, const char** argv, size_t capacity)
+{
+	size_t argc = 0;
+	char* read = line;
+
+	for (;;)
+	{
+		while (*read == ' ' || *read == '\t')
+			++read;
+
+		if (*read == 0)
+			return argc;
+
+		if (argc == capacity)
+			return (size_t)-1;
+
+		char* write = read;
+		argv[argc++] = write;
+
+		bool quoted = false;
+		for (; *read != 0 && (quoted || (*read != ' ' && *read != '\t')); ++read)
+		{
+			if (*read == '"')
+				quoted = !quoted;
+			else *write++ = *read;
+		}
+
+		if (*read != 0)
+			++read;
+		*write = 0;
+	}
+}
+
+// Script statements only take where and set commands.
+static bool
+ProgramArguments_ParseCommands(struct ProgramArguments* arguments, size_t argc, const char** argv, bool statement)
+{
+	for (size_t i = 0; i < argc;)
+	{
+		const struct CommandInfo* info = CommandInfo_Find(argv[i++]);
+
+		if (info == NULL)
+			return false;
+
+		if (statement && info->parse != Commands_Where && info->parse != Commands_Set)
+			return false;
+
+		size_t count = info->parse(arguments, argc - i, argv + i);
+
+		if (count == COMMAND_ERROR)
+			return false;
+
+		i += count;
+	}
+	return true;
+}
+
+// Parses each line of the script as a statement of where and set commands.
+// Empty lines and lines starting with '#' are skipped.
+static bool
+ProgramArguments_ParseScript(struct ProgramArguments* arguments)
+{
+	struct Buffer* script = &arguments->script;
+	if (!Buffer_Append(script, "", 1))
+		return false;
+
+	size_t capacity = 0;
+
+	for (char* line = script->data; line != NULL;)
+	{
+		char* end = strchr(line, '\n');
+		if (end != NULL)
+			*end++ = 0;
+
+		for (char* c = line; *c != 0; ++c)
+			if (*c == '\r')
+				*c = ' ';
+
+		const char* argv[256];
+		size_t argc = String_Tokenize(line, argv, ARRAY_SIZE(argv));
+		line = end;
+
+		if (argc == (size_t)-1)
+			return false;
+
+		if (argc == 0 || argv[0][0] == '#')
+			continue;
+
+		if (arguments->statementCount == capacity)
+		{
+			capacity = capacity != 0 ? capacity * 2 : 16;
+			struct ProgramArguments* statements = (struct ProgramArguments*)realloc(arguments->statements, capacity * sizeof(struct ProgramArguments));
+			if (statements == NULL)
+				return false;
+			arguments->statements = statements;
+		}
+
+		struct ProgramArguments* statement = &arguments->statements[arguments->statementCount++];
+		ProgramArguments_Init(statement);
+
+		if (!ProgramArguments_ParseCommands(statement, argc, argv, true) || statement->actionCount == 0)
+			return false;
+
+		ProgramArguments_Plan(statement);
+	}
+
+	return arguments->statementCount != 0;
+}
+
+// Patterns come first and end at the first command. Arguments starting
+// with "--" instead take every argument up to the next "--" as a pattern,
+// so that files named like commands can be given. Input tells whether
+// standard input may be read.
+static bool
+ProgramArguments_Parse(struct ProgramArguments* arguments, size_t argc, const char** argv, bool input)
+{
+	ProgramArguments_Init(arguments);
+	arguments->input = input;
+
+	bool escaped = argc != 0 && strcmp(argv[0], "--") == 0;
+
+	size_t i = escaped ? 1 : 0;
+	for (; i < argc && (escaped ? strcmp(argv[i], "--") != 0 : CommandInfo_Find(argv[i]) == NULL); ++i)
+		if (!ProgramArguments_AddPattern(arguments, argv[i]))
+			return false;
+
+	size_t patterns = escaped ? i - 1 : i;
+
+	if (escaped)
+	{
+		if (i == argc)
+			return false;
+		++i;
+	}
+
+	if (patterns == 0 || !ProgramArguments_ParseCommands(arguments, argc - i, argv + i, false))
+		return false;
+
+	if (arguments->script.data != NULL)
+	{
+		// The statements replace the top level set commands. A top level
+		// where still narrows the records all statements see.
+		if (arguments->actionCount > 0 || !ProgramArguments_ParseScript(arguments))
+			return false;
+	}
+
+	// Ordering keeps whole rows, so it needs a limit. Limited queries stop
+	// early, so they cannot be combined with aggregation or with mutations
+	// that would apply to an arbitrary part of the rows.
+	if (arguments->order.field != NULL && arguments->limit == 0)
+		return false;
+
+	if (arguments->limit != 0 && (arguments->aggregate.enabled || ProgramArguments_IsMutating(arguments)))
+		return false;
+
+	if (arguments->exists && arguments->order.field != NULL)
+		return false;
+
+	if (!arguments->projection.selected && !Projection_AddList(&arguments->projection, arguments->format->defaults))
+		return false;
+
+	ProgramArguments_Plan(arguments);
+	return true;
+}
+
+static void
+ProgramArguments_Mutate(const struct ProgramArguments* arguments, struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc)
+{
+	for (size_t i = 0, c = arguments->actionCount; i < c; ++i)
+		Action_Invoke(&arguments->actions[i], pokemon, misc);
+}
+
+// Edits a decrypted record with its own actions.
+static void
+ProgramArguments_Apply(const struct ProgramArguments* arguments, struct Pokemon* pokemon)
+{
+	Pokemon_Unscramble(pokemon);
+
+	struct Pokemon_Misc_Unpacked misc;
+	Pokemon_Misc_Unpack(&pokemon->data.misc, &misc);
+
+	ProgramArguments_Mutate(arguments, pokemon, &misc);
+	Pokemon_Misc_Pack(&pokemon->data.misc, &misc);
+	Pokemon_Scramble(pokemon);
+}
+
+// Runs the script statements in order on a decrypted record. Each
+// statement sees the edits of the ones before it. Returns whether any of
+// them matched.
+static bool
+ProgramArguments_RunScript(const struct ProgramArguments* arguments, struct Pokemon* pokemon, size_t index)
+{
+	bool matched = false;
+	for (size_t i = 0, c = arguments->statementCount; i < c; ++i)
+	{
+		const struct ProgramArguments* statement = &arguments->statements[i];
+		const struct QueryPlan* plan = &statement->plan;
+
+		if (!SlotMask_Test(&plan->slots, index)
+			|| !QueryPlan_Filter(plan, FILTER_STAGE_HEADER, pokemon, index, true)
+			|| !QueryPlan_Filter(plan, FILTER_STAGE_FIELD, pokemon, index, true)
+			|| !QueryPlan_Filter(plan, FILTER_STAGE_DECODED, pokemon, index, true))
+			continue;
+
+		ProgramArguments_Apply(statement, pokemon);
+		matched = true;
+	}
+	return matched;
+}
+
+// Set lookups do not vectorize, so set predicates are evaluated one row
+// at a time.
+static void
+Column_SelectSet(const uint16_t* column, size_t count, const struct FilterSet* set, bool expect, uint64_t* selection)
+{
+	for (size_t i = 0; i < count; ++i)
+		if (FilterSet_Test(set, column[i]) != expect)
+			selection[i / 64] &= ~((uint64_t)1 << i % 64);
+}
+
+// Evaluates the column predicates of the plan over a columnar view of the
+// decrypted records and compacts the batch down to the selected rows.
+static size_t
+QueryPlan_SelectColumns(const struct QueryPlan* plan, struct Pokemon* pokemon, uint16_t* slots, uint16_t* checksums, size_t count)
+{
+	struct PokemonColumns columns;
+	PokemonColumns_Decode(&columns, pokemon, count);
+
+	uint64_t selection[POKEMON_COLUMN_CAPACITY / 64];
+	memset(selection, 0, sizeof(selection));
+	for (size_t i = 0; i < count; ++i)
+		selection[i / 64] |= (uint64_t)1 << i % 64;
+
+	for (size_t i = 0, c = plan->predicateCount; i < c; ++i)
+	{
+		const struct FilterOp* predicate = &plan->predicates[i];
+		const uint16_t* column = columns.columns[predicate->column];
+
+		if (predicate->set != NULL)
+			Column_SelectSet(column, count, predicate->set, predicate->expect, selection);
+		else GKernels.selectColumn(column, count, predicate->key, predicate->expect, selection);
+	}
+
+	size_t selected = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if ((selection[i / 64] >> i % 64 & 1) == 0)
+			continue;
+
+		pokemon[selected] = pokemon[i];
+		slots[selected] = slots[i];
+		checksums[selected] = checksums[i];
+		++selected;
+	}
+	return selected;
+}
+
+// Working memory of a thread running queries. Workers keep one for all of
+// their files, so that once its buffers have grown, running a query on a
+// file allocates nothing.
+struct QueryWorkspace
+{
+	// Records gathered from the storage for decryption.
+	uint16_t slots[STORAGE_POKEMON_COUNT];
+	struct Pokemon pokemon[STORAGE_POKEMON_COUNT];
+	uint16_t checksums[STORAGE_POKEMON_COUNT];
+
+	// Snapshot of a file queried through the cache, and the path of its
+	// cache file.
+	struct StorageSnapshot snapshot;
+	struct Buffer path;
+
+	// Links the spare workspaces of a library battery.
+	struct QueryWorkspace* next;
+};
+
+static struct QueryWorkspace*
+QueryWorkspace_Create(void)
+{
+	struct QueryWorkspace* workspace = (struct QueryWorkspace*)malloc(sizeof(struct QueryWorkspace));
+	if (workspace != NULL)
+		Buffer_Init(&workspace->path);
+	return workspace;
+}
+
+static void
+QueryWorkspace_Destroy(struct QueryWorkspace* workspace)
+{
+	if (workspace == NULL)
+		return;
+
+	Buffer_Destroy(&workspace->path);
+	free(workspace);
+}
+
+// Maps the sections of the current save and verifies those in verify.
+// Records in storage sections left out of verify must not be read.
+static bool
+Query_LoadStorage(struct BatteryFile* battery, struct Section** sections, uint32_t verify)
+{
+	struct Save* save;
+	if (!Battery_GetCurrentSave(battery->battery, &save))
+		return false;
+
+	return Save_GetSections(save, sections) && BatteryFile_VerifySections(battery, sections, verify);
+}
+
+// Runs the query against either the battery or a cached snapshot of its
+// storage. Snapshots hold decrypted records and are only used read-only.
+static bool
+Query_Execute(const struct ProgramArguments* arguments, struct BatteryFile* battery, const struct StorageSnapshot* snapshot, struct QueryWorkspace* workspace, const struct QueryOutput* output)
+{
+	struct Section* sections[SECTION_COUNT];
+
+	if (snapshot != NULL)
+	{
+		if ((arguments->verify & VERIFY_POKEMON) && !StorageSnapshot_Verify(snapshot))
+			return false;
+	}
+	else
+	{
+		// Without strict verification, only the sections holding slots the
+		// plan can match are verified.
+		uint32_t verify = arguments->verify & VERIFY_SECTIONS
+			? SECTION_MASK_ALL
+			: PokemonStorage_GetSlotSections(&arguments->plan.slots);
+
+		if (!Query_LoadStorage(battery, sections, verify))
+			return false;
+
+		if ((arguments->verify & VERIFY_POKEMON) && !PokemonStorage_Verify(sections, workspace->pokemon, workspace->checksums))
+			return false;
+	}
+
+	bool mutate = ProgramArguments_IsMutating(arguments);
+	bool columnar = arguments->scan == SCAN_COLUMNS || snapshot != NULL;
+	assert(!mutate || snapshot == NULL);
+
+	const struct QueryPlan* plan = &arguments->plan;
+
+	uint16_t* slots = workspace->slots;
+	struct Pokemon* pokemon = workspace->pokemon;
+	uint16_t* checksums = workspace->checksums;
+	size_t count = 0;
+
+	for (size_t i = plan->slotFirst; i < plan->slotLast; ++i)
+	{
+		if (!SlotMask_Test(&plan->slots, i))
+			continue;
+
+		// Records are filtered in place and only the survivors are copied.
+		struct Pokemon scratch;
+		const struct Pokemon* stored = snapshot != NULL
+			? &snapshot->pokemon[i]
+			: PokemonStorage_Get(sections, i, &scratch);
+
+		if (!Pokemon_Exists(stored))
+			continue;
+
+		// Snapshots hold decrypted records.
+		bool decrypted = snapshot != NULL;
+
+		if (columnar
+			? !QueryPlan_FilterUncovered(plan, FILTER_STAGE_HEADER, stored, i, decrypted) || !QueryPlan_FilterUncovered(plan, FILTER_STAGE_FIELD, stored, i, decrypted)
+			: !QueryPlan_Filter(plan, FILTER_STAGE_HEADER, stored, i, decrypted) || !QueryPlan_Filter(plan, FILTER_STAGE_FIELD, stored, i, decrypted))
+			continue;
+
+		if (snapshot != NULL)
+			checksums[count] = snapshot->checksums[i];
+
+		slots[count] = (uint16_t)i;
+		pokemon[count] = *stored;
+		++count;
+
+		// Without later filters every gathered row is written.
+		if (output->ends != NULL && count == output->limit && !columnar && !QueryPlan_HasStage(plan, FILTER_STAGE_DECODED))
+			break;
+	}
+
+	if (snapshot == NULL)
+		GKernels.decryptPokemon(pokemon, count, checksums);
+
+	if (columnar)
+		count = QueryPlan_SelectColumns(plan, pokemon, slots, checksums, count);
+
+	size_t mutated = 0;
+	for (size_t j = 0; j < count; ++j)
+	{
+		struct Pokemon* current = &pokemon[j];
+		size_t i = slots[j];
+
+		if (checksums[j] != current->checksum)
+			return false;
+
+		if (!QueryPlan_Filter(plan, FILTER_STAGE_DECODED, current, i, true))
+			continue;
+
+		// Like those of a set command, script rows are written as they were
+		// before any statement changed them.
+		struct Pokemon original;
+		const struct Pokemon* shown = current;
+
+		if (arguments->statementCount != 0)
+		{
+			original = *current;
+			shown = &original;
+
+			if (!ProgramArguments_RunScript(arguments, current, i))
+				continue;
+		}
+
+		// Fields are read from the scrambled record, so only the projected
+		// strings are decoded and nothing is unscrambled unless mutating.
+		struct OutputRow row;
+
+		if (output->aggregate != NULL)
+		{
+			OutputRow_Init(&row, shown, i, 0);
+
+			if (!Aggregate_Add(output->aggregate, &arguments->aggregate, &row))
+				return false;
+		}
+		else if (output->order != NULL)
+		{
+			OutputRow_Init(&row, shown, i, 0);
+
+			struct OrderKey key;
+			key.value = OutputRow_GetNumber(&row, arguments->order.field);
+			key.file = output->file;
+			key.index = i;
+			OrderHeap_Push(output->order, &arguments->order, &key, shown);
+		}
+		else if (output->row != NULL)
+		{
+			OutputRow_Init(&row, shown, i, DECODE_NICKNAME | DECODE_TRAINER_NAME);
+
+			if (!output->row(output->context, &row))
+				break;
+		}
+		else
+		{
+			OutputRow_Init(&row, shown, i, arguments->projection.decode);
+
+			if (!arguments->exists && !arguments->format->row(output, &arguments->projection, &row))
+				return false;
+
+			if (output->ends != NULL)
+			{
+				size_t end = output->buffer->size;
+				if (!Buffer_Append(output->ends, (const char*)&end, sizeof(end)))
+					return false;
+
+				if (output->ends->size / sizeof(size_t) == output->limit)
+					break;
+			}
+		}
+
+		if (!mutate)
+			continue;
+
+		if (arguments->statementCount == 0)
+			ProgramArguments_Apply(arguments, current);
+
+		slots[mutated] = slots[j];
+		pokemon[mutated] = *current;
+		++mutated;
+	}
+
+	GKernels.encryptPokemon(pokemon, mutated);
+
+	uint32_t modified = 0;
+	for (size_t j = 0; j < mutated; ++j)
+	{
+		struct Pokemon scratch;
+		const struct Pokemon* stored = PokemonStorage_Get(sections, slots[j], &scratch);
+
+		if (memcmp(&pokemon[j], stored, sizeof(struct Pokemon)) != 0)
+			modified |= PokemonStorage_Set(sections, slots[j], &pokemon[j]);
+	}
+
+	for (size_t i = 0; i < SECTION_COUNT; ++i)
+	{
+		if (modified >> i & 1)
+		{
+			GKernels.checksumSections(sections[i], 1, &sections[i]->checksum);
+			BatteryFile_MarkSection(battery, sections[i]);
+		}
+	}
+
+	return true;
+}
+
+// The runner and the server below are only built into the program.
+#ifndef POKEQUERY_LIBRARY
+// Fills snapshot for the battery at file, whose identity is key. Reads it
+// from the cache directory if there is a current one there, otherwise
+// takes it from the battery and stores it in the directory. A snapshot
+// that cannot be stored is not an error. Path is scratch space.
+static bool
+StorageSnapshot_Load(struct StorageSnapshot* snapshot, const char* file, const struct FileKey* key, const char* directory, uint32_t verify, struct Buffer* path)
+{
+	if (directory != NULL && StorageSnapshot_Read(snapshot, directory, key, path))
+		return true;
+
+	struct BatteryFile battery;
+	if (!BatteryFile_Open(&battery, file, false))
+		return false;
+
+	struct Section* sections[SECTION_COUNT];
+
+	bool result = Query_LoadStorage(&battery, sections, verify);
+
+	if (result)
+		StorageSnapshot_Build(snapshot, sections, key);
+
+	BatteryFile_Close(&battery);
+
+	if (!result)
+		return false;
+
+	if (directory != NULL)
+		StorageSnapshot_Write(snapshot, directory, path);
+
+	return true;
+}
+
+// Snapshots hold the whole storage, so all of it is verified when one is
+// taken.
+static uint32_t
+Query_GetSnapshotSections(const struct ProgramArguments* arguments)
+{
+	return arguments->verify & VERIFY_SECTIONS ? SECTION_MASK_ALL : SECTION_MASK_STORAGE;
+}
+
+// Answers a read-only query from the snapshot cache, taking and storing a
+// new snapshot if the cached one is missing or stale.
+static bool
+Query_RunCached(const struct ProgramArguments* arguments, const char* file, struct QueryWorkspace* workspace, const struct QueryOutput* output)
+{
+	struct FileKey key;
+	if (!FileKey_Get(file, &key))
+		return false;
+
+	struct StorageSnapshot* snapshot = &workspace->snapshot;
+
+	return StorageSnapshot_Load(snapshot, file, &key, arguments->cache, Query_GetSnapshotSections(arguments), &workspace->path)
+		&& Query_Execute(arguments, NULL, snapshot, workspace, output);
+}
+
+// Decides from the trainer section alone whether a file can match.
+static bool
+Query_MatchOwner(const struct ProgramArguments* arguments, const char* file, bool* match)
+{
+	*match = true;
+	if (arguments->owner.fields == 0)
+		return true;
+
+	struct Trainer trainer;
+	if (!Trainer_Read(file, &trainer))
+		return false;
+
+	*match = OwnerQuery_Match(&arguments->owner, &trainer);
+	return true;
+}
+
+static bool
+Query_Run(const struct ProgramArguments* arguments, const char* file, struct QueryWorkspace* workspace, const struct QueryOutput* output)
+{
+	bool match;
+	if (!Query_MatchOwner(arguments, file, &match))
+		return false;
+
+	if (!match)
+		return true;
+
+	bool mutate = ProgramArguments_IsMutating(arguments);
+
+	if (arguments->cache != NULL && !mutate)
+		return Query_RunCached(arguments, file, workspace, output);
+
+	struct BatteryFile battery;
+	if (!BatteryFile_Open(&battery, file, mutate))
+		return false;
+
+	bool result = Query_Execute(arguments, &battery, NULL, workspace, output)
+		&& BatteryFile_Commit(&battery);
+
+	BatteryFile_Close(&battery);
+	return result;
+}
+
+// Sorts the rows kept by an ordered query and writes them out, with the
+// same prefixes that the rows would have had if written per file.
+static bool
+OrderHeap_Write(struct OrderHeap* heap, const struct ProgramArguments* arguments, struct Buffer* buffer)
+{
+	const struct FormatInfo* format = arguments->format;
+
+	if (format->header != NULL && !format->header(buffer, &arguments->projection))
+		return false;
+
+	OrderHeap_Sort(heap, &arguments->order);
+
+	for (size_t i = 0; i < heap->count; ++i)
+	{
+		const struct OrderEntry* entry = &heap->entries[i];
+
+		struct QueryOutput output;
+		output.buffer = buffer;
+		output.prefix = arguments->fileCount > 1 ? arguments->files[entry->key.file] : NULL;
+		output.file = entry->key.file;
+		output.aggregate = NULL;
+		output.order = NULL;
+
+		struct OutputRow row;
+		OutputRow_Init(&row, &entry->pokemon, entry->key.index, arguments->projection.decode);
+
+		if (!format->row(&output, &arguments->projection, &row))
+			return false;
+	}
+	return true;
+}
+
+struct BatchJob
+{
+	const char* file;
+	struct Buffer output;
+	struct Buffer ends;
+	bool done;
+	bool result;
+};
+
+struct Batch
+{
+	const struct ProgramArguments* arguments;
+
+	size_t jobCount;
+	struct BatchJob* jobs;
+
+	size_t next;
+	size_t flushed;
+	bool result;
+
+	// Jobs are only handed out while fewer than window of them wait to be
+	// flushed, so that a slow file does not leave the outputs of all the
+	// files after it in memory. Workers at the window wait for flushing.
+	size_t window;
+	Condition flushing;
+
+	// Unordered limited queries stop handing out jobs at last once the
+	// rows of the earlier jobs are known to reach the limit. Rows counts
+	// the rows flushed so far.
+	size_t limit;
+	size_t last;
+	size_t rows;
+	bool found;
+
+	// Totals of aggregate queries and the best rows of ordered queries.
+	// Each worker collects its own files and merges into these once it
+	// runs out of jobs.
+	struct Aggregate* aggregate;
+	struct OrderHeap* order;
+
+	// Buffers of flushed jobs, handed to the jobs started after them so
+	// that their memory is reused rather than freed.
+	struct Buffer* spares;
+	size_t spareCount;
+
+	Mutex mutex;
+};
+
+static void
+Batch_Recycle(struct Batch* batch, struct Buffer* buffer)
+{
+	if (buffer->capacity != 0)
+	{
+		buffer->size = 0;
+		batch->spares[batch->spareCount++] = *buffer;
+	}
+	Buffer_Init(buffer);
+}
+
+static void
+Batch_Reuse(struct Batch* batch, struct Buffer* buffer)
+{
+	if (batch->spareCount != 0)
+		*buffer = batch->spares[--batch->spareCount];
+}
+
+static void
+Batch_Flush(struct Batch* batch)
+{
+	size_t limit = batch->limit;
+
+	for (; batch->flushed < batch->last; ++batch->flushed)
+	{
+		struct BatchJob* job = &batch->jobs[batch->flushed];
+
+		if (!job->done)
+			break;
+
+		size_t size = job->output.size;
+
+		if (limit != 0)
+		{
+			const size_t* ends = (const size_t*)job->ends.data;
+			size_t rows = job->ends.size / sizeof(size_t);
+
+			if (rows >= limit - batch->rows)
+			{
+				rows = limit - batch->rows;
+				size = rows != 0 ? ends[rows - 1] : 0;
+				batch->last = batch->flushed + 1;
+			}
+			batch->rows += rows;
+		}
+
+		fwrite(job->output.data, 1, size, stdout);
+		Batch_Recycle(batch, &job->output);
+		Batch_Recycle(batch, &job->ends);
+
+		if (!job->result)
+		{
+			if (batch->jobCount > 1)
+				fprintf(stderr, "%s: query failed\n", job->file);
+			batch->result = false;
+		}
+	}
+
+	Condition_Broadcast(&batch->flushing);
+}
+
+static void
+Batch_Worker(void* context)
+{
+	struct Batch* batch = (struct Batch*)context;
+	bool prefix = batch->jobCount > 1;
+
+	struct QueryWorkspace* workspace = QueryWorkspace_Create();
+	if (workspace == NULL)
+	{
+		Mutex_Lock(&batch->mutex);
+		batch->result = false;
+		Mutex_Unlock(&batch->mutex);
+		return;
+	}
+
+	struct Aggregate* aggregate = NULL;
+	if (batch->aggregate != NULL)
+	{
+		aggregate = (struct Aggregate*)malloc(sizeof(struct Aggregate));
+		if (aggregate == NULL)
+		{
+			QueryWorkspace_Destroy(workspace);
+			Mutex_Lock(&batch->mutex);
+			batch->result = false;
+			Mutex_Unlock(&batch->mutex);
+			return;
+		}
+		Aggregate_Init(aggregate);
+	}
+
+	struct OrderHeap order;
+	if (batch->order != NULL && !OrderHeap_Init(&order, batch->order->capacity))
+	{
+		QueryWorkspace_Destroy(workspace);
+		Mutex_Lock(&batch->mutex);
+		batch->result = false;
+		Mutex_Unlock(&batch->mutex);
+		return;
+	}
+
+	Mutex_Lock(&batch->mutex);
+	while (batch->next < batch->last)
+	{
+		if (batch->next - batch->flushed >= batch->window)
+		{
+			Condition_Wait(&batch->flushing, &batch->mutex);
+			continue;
+		}
+
+		struct BatchJob* job = &batch->jobs[batch->next++];
+		size_t limit = batch->limit - batch->rows;
+
+		Batch_Reuse(batch, &job->output);
+		if (batch->limit != 0)
+			Batch_Reuse(batch, &job->ends);
+		Mutex_Unlock(&batch->mutex);
+
+		struct QueryOutput output;
+		output.buffer = &job->output;
+		output.prefix = prefix ? job->file : NULL;
+		output.file = (uint32_t)(job - batch->jobs);
+		output.aggregate = aggregate;
+		output.order = batch->order != NULL ? &order : NULL;
+		output.ends = batch->limit != 0 ? &job->ends : NULL;
+		output.limit = limit;
+		output.row = NULL;
+		output.context = NULL;
+
+		bool result = Query_Run(batch->arguments, job->file, workspace, &output);
+
+		Mutex_Lock(&batch->mutex);
+		job->result = result;
+		job->done = true;
+
+		if (batch->limit != 0 && result)
+		{
+			size_t index = (size_t)(job - batch->jobs);
+			size_t rows = job->ends.size / sizeof(size_t);
+
+			// Any match answers an existence query. Otherwise the files
+			// after this one can only add rows past the limit.
+			if (batch->arguments->exists && rows != 0)
+			{
+				batch->found = true;
+				batch->last = batch->next;
+			}
+			else if (rows >= batch->limit - batch->rows && batch->last > index + 1)
+				batch->last = index + 1;
+		}
+
+		Batch_Flush(batch);
+	}
+
+	if (aggregate != NULL)
+	{
+		if (!Aggregate_Merge(batch->aggregate, aggregate, &batch->arguments->aggregate))
+			batch->result = false;
+
+		Aggregate_Destroy(aggregate);
+		free(aggregate);
+	}
+
+	if (batch->order != NULL)
+	{
+		OrderHeap_Merge(batch->order, &order, &batch->arguments->order);
+		OrderHeap_Destroy(&order);
+	}
+	Mutex_Unlock(&batch->mutex);
+
+	QueryWorkspace_Destroy(workspace);
+}
+
+// Runs the query over every file. Rows receives the number of rows
+// written by a limited query, or one if an existence query matched.
+static bool
+Batch_Run(const struct ProgramArguments* arguments, size_t* rows)
+{
+	*rows = 0;
+
+	size_t jobCount = arguments->fileCount;
+	if (jobCount == 0)
+		return true;
+
+	struct BatchJob* jobs = (struct BatchJob*)malloc(jobCount * sizeof(struct BatchJob));
+	if (jobs == NULL)
+		return false;
+
+	// Each job gives back at most its output and ends buffers.
+	struct Buffer* spares = (struct Buffer*)malloc(2 * jobCount * sizeof(struct Buffer));
+	if (spares == NULL)
+	{
+		free(jobs);
+		return false;
+	}
+
+	for (size_t i = 0; i < jobCount; ++i)
+	{
+		struct BatchJob* job = &jobs[i];
+		job->file = arguments->files[i];
+		Buffer_Init(&job->output);
+		Buffer_Init(&job->ends);
+		job->done = false;
+		job->result = false;
+	}
+
+	// Rows reach stdout as whole per-file buffers, so let stdio pass them
+	// through in large writes.
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+#ifdef _WIN32
+	if (arguments->format->binary)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	if (arguments->format->header != NULL && !arguments->aggregate.enabled && arguments->order.field == NULL && !arguments->exists)
+	{
+		struct Buffer header;
+		Buffer_Init(&header);
+
+		bool result = arguments->format->header(&header, &arguments->projection);
+		if (result)
+			fwrite(header.data, 1, header.size, stdout);
+
+		Buffer_Destroy(&header);
+
+		if (!result)
+		{
+			free(spares);
+			free(jobs);
+			return false;
+		}
+	}
+
+	struct Batch batch;
+	batch.arguments = arguments;
+	batch.jobCount = jobCount;
+	batch.jobs = jobs;
+	batch.next = 0;
+	batch.flushed = 0;
+	batch.result = true;
+	batch.limit = arguments->order.field == NULL ? arguments->limit : 0;
+	batch.last = jobCount;
+	batch.rows = 0;
+	batch.found = false;
+	batch.aggregate = NULL;
+	batch.order = NULL;
+	batch.spares = spares;
+	batch.spareCount = 0;
+	Mutex_Init(&batch.mutex);
+	Condition_Init(&batch.flushing);
+
+	struct OrderHeap order;
+	if (arguments->order.field != NULL)
+	{
+		if (!OrderHeap_Init(&order, arguments->limit))
+		{
+			Condition_Destroy(&batch.flushing);
+			Mutex_Destroy(&batch.mutex);
+			free(spares);
+			free(jobs);
+			return false;
+		}
+		batch.order = &order;
+	}
+
+	if (arguments->aggregate.enabled)
+	{
+		batch.aggregate = (struct Aggregate*)malloc(sizeof(struct Aggregate));
+		if (batch.aggregate == NULL)
+		{
+			Condition_Destroy(&batch.flushing);
+			Mutex_Destroy(&batch.mutex);
+			free(spares);
+			free(jobs);
+			return false;
+		}
+		Aggregate_Init(batch.aggregate);
+	}
+
+	size_t threadCount = arguments->threadCount;
+	if (threadCount == 0)
+		threadCount = Thread_GetHardwareConcurrency();
+	if (threadCount > jobCount)
+		threadCount = jobCount;
+
+	batch.window = 2 * threadCount;
+
+	size_t started = 0;
+	Thread* threads = (Thread*)malloc(threadCount * sizeof(Thread));
+
+	if (threads != NULL)
+		for (; started + 1 < threadCount; ++started)
+			if (!Thread_Create(&threads[started], Batch_Worker, &batch))
+				break;
+
+	Batch_Worker(&batch);
+
+	for (size_t i = 0; i < started; ++i)
+		Thread_Join(threads[i]);
+
+	free(threads);
+	Condition_Destroy(&batch.flushing);
+	Mutex_Destroy(&batch.mutex);
+
+	// Jobs past the limit are either never run or never flushed.
+	for (size_t i = batch.flushed; i < jobCount; ++i)
+	{
+		Buffer_Destroy(&jobs[i].output);
+		Buffer_Destroy(&jobs[i].ends);
+	}
+	free(jobs);
+
+	for (size_t i = 0; i < batch.spareCount; ++i)
+		Buffer_Destroy(&spares[i]);
+	free(spares);
+
+	*rows = batch.rows;
+
+	if (batch.aggregate != NULL)
+	{
+		struct Buffer output;
+		Buffer_Init(&output);
+
+		if (batch.result && Aggregate_Write(batch.aggregate, &arguments->aggregate, arguments->format, &output))
+			fwrite(output.data, 1, output.size, stdout);
+		else batch.result = false;
+
+		Buffer_Destroy(&output);
+		Aggregate_Destroy(batch.aggregate);
+		free(batch.aggregate);
+	}
+
+	if (batch.order != NULL)
+	{
+		struct Buffer output;
+		Buffer_Init(&output);
+
+		if (batch.result && OrderHeap_Write(batch.order, arguments, &output))
+			fwrite(output.data, 1, output.size, stdout);
+		else batch.result = false;
+
+		*rows = batch.order->count;
+
+		Buffer_Destroy(&output);
+		OrderHeap_Destroy(batch.order);
+	}
+
+	if (arguments->exists)
+	{
+		*rows = batch.found ? 1 : 0;
+		return batch.found || batch.result;
+	}
+
+	fflush(stdout);
+	return batch.result;
+}
+
+struct SharedSnapshot
+{
+	size_t references;
+	struct StorageSnapshot snapshot;
+};
+
+struct SnapshotCacheEntry
+{
+	char* path;
+	uint64_t hash;
+	struct SharedSnapshot* shared;
+
+	struct SnapshotCacheEntry* chain;
+	struct SnapshotCacheEntry* prev;
+	struct SnapshotCacheEntry* next;
+};
+
+// In-memory LRU cache of storage snapshots keyed by path. A cached
+// snapshot is only returned while the file identity still matches it.
+// Snapshots are reference counted so that eviction never frees one that
+// a query is still reading.
+struct SnapshotCache
+{
+	Mutex mutex;
+
+	size_t count;
+	size_t capacity;
+
+	size_t bucketCount;
+	struct SnapshotCacheEntry** buckets;
+
+	struct SnapshotCacheEntry* head;
+	struct SnapshotCacheEntry* tail;
+};
+
+static uint64_t
+String_Hash(const char* string)
+{
+	uint64_t hash = 0xCBF29CE484222325;
+	for (; *string != 0; ++string)
+		hash = (hash ^ (byte)*string) * 0x100000001B3;
+	return hash;
+}
 
 static bool
-ParseContext_StringSpan(void* context, struct StringSpan text)
+SnapshotCache_Init(struct SnapshotCache* cache, size_t capacity)
 {
-	CONTEXT_SET(struct StringSpan) = text;
+	size_t bucketCount = 16;
+	while (bucketCount < capacity)
+		bucketCount *= 2;
+
+	cache->buckets = (struct SnapshotCacheEntry**)calloc(bucketCount, sizeof(struct SnapshotCacheEntry*));
+	if (cache->buckets == NULL)
+		return false;
+
+	Mutex_Init(&cache->mutex);
+	cache->count = 0;
+	cache->capacity = capacity;
+	cache->bucketCount = bucketCount;
+	cache->head = NULL;
+	cache->tail = NULL;
+	return true;
+}
+
+static void
+SharedSnapshot_Release(struct SharedSnapshot* shared)
+{
+	if (--shared->references == 0)
+		free(shared);
+}
+
+static void
+SnapshotCache_Unlink(struct SnapshotCache* cache, struct SnapshotCacheEntry* entry)
+{
+	struct SnapshotCacheEntry** link = &cache->buckets[entry->hash & (cache->bucketCount - 1)];
+	while (*link != entry)
+		link = &(*link)->chain;
+	*link = entry->chain;
+
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else cache->head = entry->next;
+
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else cache->tail = entry->prev;
+
+	--cache->count;
+
+	SharedSnapshot_Release(entry->shared);
+	free(entry->path);
+	free(entry);
+}
+
+static void
+SnapshotCache_Destroy(struct SnapshotCache* cache)
+{
+	while (cache->head != NULL)
+		SnapshotCache_Unlink(cache, cache->head);
+
+	free(cache->buckets);
+	Mutex_Destroy(&cache->mutex);
+}
+
+static struct SnapshotCacheEntry*
+SnapshotCache_Find(struct SnapshotCache* cache, const char* path, uint64_t hash)
+{
+	struct SnapshotCacheEntry* entry = cache->buckets[hash & (cache->bucketCount - 1)];
+	for (; entry != NULL; entry = entry->chain)
+		if (entry->hash == hash && strcmp(entry->path, path) == 0)
+			return entry;
+	return NULL;
+}
+
+// Returns a referenced snapshot of path taken under key, or NULL.
+static struct SharedSnapshot*
+SnapshotCache_Acquire(struct SnapshotCache* cache, const char* path, const struct FileKey* key)
+{
+	uint64_t hash = String_Hash(path);
+	struct SharedSnapshot* shared = NULL;
+
+	Mutex_Lock(&cache->mutex);
+
+	struct SnapshotCacheEntry* entry = SnapshotCache_Find(cache, path, hash);
+	if (entry != NULL && memcmp(&entry->shared->snapshot.key, key, sizeof(*key)) != 0)
+	{
+		SnapshotCache_Unlink(cache, entry);
+		entry = NULL;
+	}
+
+	if (entry != NULL)
+	{
+		if (entry != cache->head)
+		{
+			entry->prev->next = entry->next;
+			if (entry->next != NULL)
+				entry->next->prev = entry->prev;
+			else cache->tail = entry->prev;
+
+			entry->prev = NULL;
+			entry->next = cache->head;
+			cache->head->prev = entry;
+			cache->head = entry;
+		}
+
+		shared = entry->shared;
+		++shared->references;
+	}
+
+	Mutex_Unlock(&cache->mutex);
+	return shared;
+}
+
+static void
+SnapshotCache_Release(struct SnapshotCache* cache, struct SharedSnapshot* shared)
+{
+	Mutex_Lock(&cache->mutex);
+	SharedSnapshot_Release(shared);
+	Mutex_Unlock(&cache->mutex);
+}
+
+static void
+SnapshotCache_Remove(struct SnapshotCache* cache, const char* path)
+{
+	uint64_t hash = String_Hash(path);
+
+	Mutex_Lock(&cache->mutex);
+
+	struct SnapshotCacheEntry* entry = SnapshotCache_Find(cache, path, hash);
+	if (entry != NULL)
+		SnapshotCache_Unlink(cache, entry);
+
+	Mutex_Unlock(&cache->mutex);
+}
+
+// Adds shared as the most recent snapshot of path, replacing any older
+// one and evicting the least recently used entries beyond capacity.
+static void
+SnapshotCache_Insert(struct SnapshotCache* cache, const char* path, struct SharedSnapshot* shared)
+{
+	uint64_t hash = String_Hash(path);
+
+	struct SnapshotCacheEntry* entry = (struct SnapshotCacheEntry*)malloc(sizeof(struct SnapshotCacheEntry));
+	char* copy = String_Duplicate(path, strlen(path));
+
+	if (entry == NULL || copy == NULL)
+	{
+		free(entry);
+		free(copy);
+		return;
+	}
+
+	Mutex_Lock(&cache->mutex);
+
+	struct SnapshotCacheEntry* existing = SnapshotCache_Find(cache, path, hash);
+	if (existing != NULL)
+		SnapshotCache_Unlink(cache, existing);
+
+	entry->path = copy;
+	entry->hash = hash;
+	entry->shared = shared;
+	++shared->references;
+
+	struct SnapshotCacheEntry** bucket = &cache->buckets[hash & (cache->bucketCount - 1)];
+	entry->chain = *bucket;
+	*bucket = entry;
+
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (cache->head != NULL)
+		cache->head->prev = entry;
+	else cache->tail = entry;
+	cache->head = entry;
+
+	if (++cache->count > cache->capacity)
+		SnapshotCache_Unlink(cache, cache->tail);
+
+	Mutex_Unlock(&cache->mutex);
+}
+
+#ifdef _WIN32
+typedef SOCKET Socket;
+#	define SOCKET_INVALID INVALID_SOCKET
+#else
+typedef int Socket;
+#	define SOCKET_INVALID (-1)
+#endif
+
+static void
+Socket_Close(Socket socket)
+{
+#ifdef _WIN32
+	closesocket(socket);
+#else
+	close(socket);
+#endif
+}
+
+static bool
+Socket_Send(Socket socket, const char* data, size_t size)
+{
+	while (size != 0)
+	{
+		int chunk = size > 0x40000000 ? 0x40000000 : (int)size;
+		int sent = (int)send(socket, data, chunk, 0);
+		if (sent <= 0)
+			return false;
+
+		data += sent;
+		size -= sent;
+	}
 	return true;
 }
 
+struct ServerConnection;
+
+struct Server
+{
+	struct SnapshotCache cache;
+
+	// Serializes queries that modify files.
+	Mutex writer;
+
+	// Guards the open connections and the stop flag. Idle is signaled when
+	// the last connection closes.
+	Mutex mutex;
+	Condition idle;
+	struct ServerConnection* connections;
+	bool stopping;
+
+	struct sockaddr_un address;
+};
+
+struct ServerConnection
+{
+	struct Server* server;
+	Socket socket;
+
+	struct ServerConnection* previous;
+	struct ServerConnection* next;
+};
+
+// Adds the connection to the open connections, unless the server is
+// stopping.
 static bool
-ParseContext_uint8(void* context, struct StringSpan text)
+Server_AddConnection(struct Server* server, struct ServerConnection* connection)
 {
-	uint32_t value;
-	bool result = ParseUInt32(text, 10, UINT8_MAX, &value);
-	*(uint8_t*)context = (uint8_t)value;
+	Mutex_Lock(&server->mutex);
+	bool result = !server->stopping;
+
+	if (result)
+	{
+		connection->previous = NULL;
+		connection->next = server->connections;
+		if (server->connections != NULL)
+			server->connections->previous = connection;
+		server->connections = connection;
+	}
+
+	Mutex_Unlock(&server->mutex);
 	return result;
 }
 
+static void
+Server_RemoveConnection(struct Server* server, struct ServerConnection* connection)
+{
+	Mutex_Lock(&server->mutex);
+
+	if (connection->previous != NULL)
+		connection->previous->next = connection->next;
+	else server->connections = connection->next;
+
+	if (connection->next != NULL)
+		connection->next->previous = connection->previous;
+
+	if (server->connections == NULL)
+		Condition_Broadcast(&server->idle);
+
+	Mutex_Unlock(&server->mutex);
+}
+
+// Ends the receives of all open connections and wakes the accept loop
+// with a connection of its own.
+static void
+Server_Stop(struct Server* server)
+{
+	Mutex_Lock(&server->mutex);
+	server->stopping = true;
+
+	for (struct ServerConnection* connection = server->connections; connection != NULL; connection = connection->next)
+#ifdef _WIN32
+		shutdown(connection->socket, SD_BOTH);
+#else
+		shutdown(connection->socket, SHUT_RDWR);
+#endif
+
+	Mutex_Unlock(&server->mutex);
+
+	Socket wake = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (wake != SOCKET_INVALID)
+	{
+		connect(wake, (const struct sockaddr*)&server->address, sizeof(server->address));
+		Socket_Close(wake);
+	}
+}
+
 static bool
-ParseContext_uint16(void* context, struct StringSpan text)
+Server_Query(struct Server* server, struct QueryWorkspace* workspace, const struct ProgramArguments* arguments, const char* file, const struct QueryOutput* output)
 {
-	uint32_t value;
-	bool result = ParseUInt32(text, 10, UINT16_MAX, &value);
-	*(uint16_t*)context = (uint16_t)value;
+	if (ProgramArguments_IsMutating(arguments))
+	{
+		// Query_Run reads the owner itself.
+		Mutex_Lock(&server->writer);
+		bool result = Query_Run(arguments, file, workspace, output);
+		SnapshotCache_Remove(&server->cache, file);
+		Mutex_Unlock(&server->writer);
+		return result;
+	}
+
+	bool match;
+	if (!Query_MatchOwner(arguments, file, &match))
+		return false;
+
+	if (!match)
+		return true;
+
+	struct FileKey key;
+	if (!FileKey_Get(file, &key))
+		return false;
+
+	struct SharedSnapshot* shared = SnapshotCache_Acquire(&server->cache, file, &key);
+
+	if (shared == NULL)
+	{
+		shared = (struct SharedSnapshot*)malloc(sizeof(struct SharedSnapshot));
+		if (shared == NULL)
+			return false;
+
+		shared->references = 1;
+
+		if (!StorageSnapshot_Load(&shared->snapshot, file, &key, arguments->cache, Query_GetSnapshotSections(arguments), &workspace->path))
+		{
+			free(shared);
+			return false;
+		}
+
+		SnapshotCache_Insert(&server->cache, file, shared);
+	}
+
+	bool result = Query_Execute(arguments, NULL, &shared->snapshot, workspace, output);
+
+	SnapshotCache_Release(&server->cache, shared);
 	return result;
 }
 
 static bool
-ParseContext_uint32(void* context, struct StringSpan text)
+Server_Execute(struct Server* server, struct QueryWorkspace* workspace, char* line, struct Buffer* output)
 {
-	return ParseUInt32(text, 10, 0, (uint32_t*)context);
+	const char* argv[256];
+	size_t argc = String_Tokenize(line, argv, ARRAY_SIZE(argv));
+
+	if (argc == (size_t)-1)
+		return false;
+
+	struct ProgramArguments arguments;
+	bool result = ProgramArguments_Parse(&arguments, argc, argv, false);
+
+	struct Aggregate* aggregate = NULL;
+	if (result && arguments.aggregate.enabled)
+	{
+		aggregate = (struct Aggregate*)malloc(sizeof(struct Aggregate));
+		if (aggregate != NULL)
+			Aggregate_Init(aggregate);
+		else result = false;
+	}
+
+	struct OrderHeap order;
+	bool ordered = result && arguments.order.field != NULL;
+	if (ordered)
+		result = ordered = OrderHeap_Init(&order, arguments.limit);
+	else if (result && !arguments.aggregate.enabled && !arguments.exists && arguments.format->header != NULL)
+		result = arguments.format->header(output, &arguments.projection);
+
+	size_t limit = ordered ? 0 : arguments.limit;
+	size_t rows = 0;
+
+	struct Buffer ends;
+	Buffer_Init(&ends);
+
+	for (size_t i = 0; result && i < arguments.fileCount && (limit == 0 || rows < limit); ++i)
+	{
+		const char* file = arguments.files[i];
+
+		struct QueryOutput query;
+		query.buffer = output;
+		query.prefix = arguments.fileCount > 1 ? file : NULL;
+		query.file = (uint32_t)i;
+		query.aggregate = aggregate;
+		query.order = ordered ? &order : NULL;
+		query.ends = limit != 0 ? &ends : NULL;
+		query.limit = limit - rows;
+		query.row = NULL;
+		query.context = NULL;
+
+		ends.size = 0;
+		if (!Server_Query(server, workspace, &arguments, file, &query))
+		{
+			if (arguments.fileCount > 1)
+				Buffer_Printf(output, "%s: query failed\n", file);
+			result = false;
+		}
+		rows += ends.size / sizeof(size_t);
+	}
+	Buffer_Destroy(&ends);
+
+	if (result && arguments.exists)
+		result = Buffer_AppendString(output, rows != 0 ? "true\n" : "false\n");
+
+	if (aggregate != NULL)
+	{
+		if (result)
+			result = Aggregate_Write(aggregate, &arguments.aggregate, arguments.format, output);
+
+		Aggregate_Destroy(aggregate);
+		free(aggregate);
+	}
+
+	if (ordered)
+	{
+		if (result)
+			result = OrderHeap_Write(&order, &arguments, output);
+
+		OrderHeap_Destroy(&order);
+	}
+
+	ProgramArguments_Destroy(&arguments);
+	return result;
+}
+
+// Reads newline terminated requests and answers each one with a header
+// line "OK <size>" or "ERROR <size>" followed by size bytes of output.
+// The request "shutdown" stops the server once open connections close.
+static void
+Server_Connection(void* context)
+{
+	struct ServerConnection* connection = (struct ServerConnection*)context;
+
+	struct Buffer input;
+	Buffer_Init(&input);
+
+	struct Buffer output;
+	Buffer_Init(&output);
+
+	struct QueryWorkspace* workspace = QueryWorkspace_Create();
+
+	size_t scanned = 0;
+	while (workspace != NULL)
+	{
+		char* newline = (char*)memchr(input.data + scanned, '\n', input.size - scanned);
+
+		if (newline == NULL)
+		{
+			scanned = input.size;
+
+			if (!Buffer_Reserve(&input, input.size + 4096))
+				break;
+
+			int chunk = (int)(input.capacity - input.size);
+			int received = (int)recv(connection->socket, input.data + input.size, chunk, 0);
+			if (received <= 0)
+				break;
+
+			input.size += received;
+			continue;
+		}
+
+		size_t length = newline - input.data;
+		*newline = 0;
+		if (length != 0 && input.data[length - 1] == '\r')
+			input.data[length - 1] = 0;
+
+		output.size = 0;
+
+		if (strcmp(input.data, "shutdown") == 0)
+		{
+			Socket_Send(connection->socket, "OK 0\n", 5);
+			Server_Stop(connection->server);
+			break;
+		}
+
+		bool result = Server_Execute(connection->server, workspace, input.data, &output);
+
+		char header[64];
+		int headerSize = snprintf(header, sizeof(header), "%s %llu\n", result ? "OK" : "ERROR", (unsigned long long)output.size);
+
+		if (!Socket_Send(connection->socket, header, headerSize) || !Socket_Send(connection->socket, output.data, output.size))
+			break;
+
+		input.size -= length + 1;
+		memmove(input.data, input.data + length + 1, input.size);
+		scanned = 0;
+	}
+
+	QueryWorkspace_Destroy(workspace);
+	Buffer_Destroy(&output);
+	Buffer_Destroy(&input);
+
+	Server_RemoveConnection(connection->server, connection);
+	Socket_Close(connection->socket);
+	free(connection);
 }
 
 static bool
-ParseContext_Gender(void* context, struct StringSpan text)
+Server_Run(const char* path, size_t argc, const char** argv)
 {
-	if (text.size != 1)
+	uint32_t capacity = 4096;
+	if (argc > 1 || (argc == 1 && !ParseUInt32(StringSpan_FromCString(argv[0]), 10, 0, &capacity)) || capacity == 0)
 		return false;
 
-	bool gender;
-	switch (*text.data)
+	struct Server server;
+	struct sockaddr_un* address = &server.address;
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(address->sun_path))
+		return false;
+	strcpy(address->sun_path, path);
+
+#ifdef _WIN32
+	WSADATA data;
+	if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+		return false;
+	DeleteFileA(path);
+#else
+	signal(SIGPIPE, SIG_IGN);
+	unlink(path);
+#endif
+
+	Socket listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	bool result = listener != SOCKET_INVALID;
+
+	if (result)
 	{
-	case 'm':
-	case 'M':
-		gender = false;
-		break;
+		result = bind(listener, (const struct sockaddr*)address, sizeof(*address)) == 0
+			&& listen(listener, SOMAXCONN) == 0;
+	}
 
-	case 'f':
-	case 'F':
-		gender = true;
-		break;
+	if (result && SnapshotCache_Init(&server.cache, capacity))
+	{
+		Mutex_Init(&server.writer);
+		Mutex_Init(&server.mutex);
+		Condition_Init(&server.idle);
+		server.connections = NULL;
+		server.stopping = false;
+
+		for (;;)
+		{
+			Socket client = accept(listener, NULL, NULL);
+
+			if (client == SOCKET_INVALID)
+			{
+				// Running out of descriptors or memory passes as connections
+				// close, so wait for that instead of spinning. Other errors
+				// leave the listener unusable.
+#ifdef _WIN32
+				int error = WSAGetLastError();
+				if (error == WSAEINTR || error == WSAECONNRESET)
+					continue;
+				if (error == WSAEMFILE || error == WSAENOBUFS)
+#else
+				int error = errno;
+				if (error == EINTR || error == ECONNABORTED)
+					continue;
+				if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM)
+#endif
+				{
+					Thread_Sleep(100);
+					continue;
+				}
+
+				result = false;
+				Server_Stop(&server);
+				break;
+			}
+
+			struct ServerConnection* connection = (struct ServerConnection*)malloc(sizeof(struct ServerConnection));
+
+			if (connection != NULL)
+			{
+				connection->server = &server;
+				connection->socket = client;
+
+				if (!Server_AddConnection(&server, connection))
+				{
+					free(connection);
+					Socket_Close(client);
+					break;
+				}
+
+				Thread thread;
+				if (Thread_Create(&thread, Server_Connection, connection))
+				{
+					Thread_Detach(thread);
+					continue;
+				}
+
+				Server_RemoveConnection(&server, connection);
+			}
+
+			free(connection);
+			Socket_Close(client);
+		}
+
+		Mutex_Lock(&server.mutex);
+		while (server.connections != NULL)
+			Condition_Wait(&server.idle, &server.mutex);
+		Mutex_Unlock(&server.mutex);
 
-	default:
-		return false;
+		Condition_Destroy(&server.idle);
+		Mutex_Destroy(&server.mutex);
+		Mutex_Destroy(&server.writer);
+		SnapshotCache_Destroy(&server.cache);
 	}
+	else result = false;
 
-	CONTEXT_SET(bool) = gender;
-	return true;
+	if (listener != SOCKET_INVALID)
+		Socket_Close(listener);
+
+#ifdef _WIN32
+	DeleteFileA(path);
+#else
+	unlink(path);
+#endif
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	return result;
 }
+#endif
 
-typedef bool FnFilter(const struct Pokemon* pokemon, const struct Pokemon_Misc_Unpacked* misc, size_t index, const void* context);
-typedef void FnAction(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context);
+static_assert(ARRAY_SIZE(GFilters) == POKEQUERY_FILTER_COUNT, "PokeQuery_Filter does not match GFilters");
+static_assert(ARRAY_SIZE(GNameFilters) == POKEQUERY_NAME_FILTER_COUNT, "PokeQuery_NameFilter does not match GNameFilters");
+static_assert(ARRAY_SIZE(GActions) == POKEQUERY_ACTION_COUNT, "PokeQuery_Action does not match GActions");
+static_assert(ARRAY_SIZE(GFields) == POKEQUERY_FIELD_COUNT, "PokeQuery_Field does not match GFields");
 
-struct Filter
+struct PokeQuery_Battery
 {
-	FnFilter* func;
-	byte context[CONTEXT_SIZE];
-	bool expect;
+	RwLock lock;
+	bool writable;
+	struct FileKey key;
+	struct BatteryFile file;
+
+	// Decrypted records read by selects, rebuilt after each update.
+	struct StorageSnapshot snapshot;
+
+	// Workspaces of finished queries. Concurrent selects each take their
+	// own, so there are as many as selects ever ran at once.
+	Mutex mutex;
+	struct QueryWorkspace* spares;
 };
 
-static bool
-Filter_Invoke(const struct Filter* filter, const struct Pokemon* pokemon, const struct Pokemon_Misc_Unpacked* misc, size_t index)
+struct PokeQuery_Query
 {
-	return filter->func(pokemon, misc, index, &filter->context) == filter->expect;
-}
+	struct ProgramArguments arguments;
 
-static bool
-Filters_Box(const struct Pokemon* pokemon, const struct Pokemon_Misc_Unpacked* misc, size_t index, const void* context)
+	// Copies of the strings referenced by actions.
+	size_t stringCount;
+	char* strings[32];
+};
+
+struct PokeQuery_Row
 {
-	UNUSED(pokemon, misc);
+	struct OutputRow row;
+};
 
-	return (index / STORAGE_BOX_SIZE) + 1 == CONTEXT(uint32_t);
-}
+struct PokeQuery_Callback
+{
+	PokeQuery_FnRow* row;
+	void* context;
+};
 
 static bool
-Filters_Slot(const struct Pokemon* pokemon, const struct Pokemon_Misc_Unpacked* misc, size_t index, const void* context)
+PokeQuery_InvokeRow(void* context, const struct OutputRow* row)
 {
-	UNUSED(pokemon, misc);
-
-	return (index % STORAGE_BOX_SIZE) + 1 == CONTEXT(uint32_t);
+	const struct PokeQuery_Callback* callback = (const struct PokeQuery_Callback*)context;
+	return callback->row == NULL || callback->row(callback->context, (const struct PokeQuery_Row*)row);
 }
 
-static bool
-Filters_Pokedex(const struct Pokemon* pokemon, const struct Pokemon_Misc_Unpacked* misc, size_t index, const void* context)
+static struct QueryWorkspace*
+PokeQuery_Battery_AcquireWorkspace(struct PokeQuery_Battery* battery)
 {
-	UNUSED(misc, index);
+	Mutex_Lock(&battery->mutex);
+	struct QueryWorkspace* workspace = battery->spares;
+	if (workspace != NULL)
+		battery->spares = workspace->next;
+	Mutex_Unlock(&battery->mutex);
 
-	return GPokemon[pokemon->data.growth.species].index == CONTEXT(uint16_t);
+	return workspace != NULL ? workspace : QueryWorkspace_Create();
 }
 
-static bool
-Filters_Trainer(const struct Pokemon* pokemon, const struct Pokemon_Misc_Unpacked* misc, size_t index, const void* context)
+static void
+PokeQuery_Battery_ReleaseWorkspace(struct PokeQuery_Battery* battery, struct QueryWorkspace* workspace)
 {
-	UNUSED(misc, index);
-
-	return pokemon->trainerPublic == CONTEXT(uint16_t);
+	Mutex_Lock(&battery->mutex);
+	workspace->next = battery->spares;
+	battery->spares = workspace;
+	Mutex_Unlock(&battery->mutex);
 }
 
 static bool
-Filters_TrainerGender(const struct Pokemon* pokemon, const struct Pokemon_Misc_Unpacked* misc, size_t index, const void* context)
+PokeQuery_Battery_Execute(struct PokeQuery_Battery* battery, const struct PokeQuery_Query* query, PokeQuery_FnRow* row, void* context, bool update)
 {
-	UNUSED(pokemon, index);
+	struct PokeQuery_Callback callback;
+	callback.row = row;
+	callback.context = context;
+
+	struct QueryOutput output;
+	output.buffer = NULL;
+	output.prefix = NULL;
+	output.file = 0;
+	output.aggregate = NULL;
+	output.order = NULL;
+	output.ends = NULL;
+	output.limit = 0;
+	output.row = PokeQuery_InvokeRow;
+	output.context = &callback;
+
+	struct QueryWorkspace* workspace = PokeQuery_Battery_AcquireWorkspace(battery);
+	if (workspace == NULL)
+		return false;
 
-	return misc->origin.gender == CONTEXT(bool);
-}
+	bool result;
+	if (update)
+	{
+		struct Section* sections[SECTION_COUNT];
 
-struct FilterInfo
-{
-	const char* name;
-	FnFilter* func;
-	FnParseContext* parseContext;
-};
+		result = Query_Execute(&query->arguments, &battery->file, NULL, workspace, &output)
+			&& Query_LoadStorage(&battery->file, sections, SECTION_MASK_STORAGE);
 
-struct FilterInfo const GFilters[] = {
-	{ "box", Filters_Box, ParseContext_uint32 },
-	{ "slot", Filters_Slot, ParseContext_uint32 },
-	{ "pokedex", Filters_Pokedex, ParseContext_uint16 },
-	{ "trainer-id", Filters_Trainer, ParseContext_uint16 },
-	{ "trainer-gender", Filters_TrainerGender, ParseContext_Gender },
-};
+		if (result)
+			StorageSnapshot_Build(&battery->snapshot, sections, &battery->key);
+	}
+	else result = Query_Execute(&query->arguments, NULL, &battery->snapshot, workspace, &output);
 
-struct Action
+	PokeQuery_Battery_ReleaseWorkspace(battery, workspace);
+	return result;
+}
+
+#ifdef _WIN32
+static INIT_ONCE GKernelsOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK
+PokeQuery_InitOnce(PINIT_ONCE once, PVOID param, PVOID* context)
 {
-	FnAction* func;
-	byte context[CONTEXT_SIZE];
-};
+	UNUSED(once, param, context);
 
-static void
-Action_Invoke(const struct Action* action, struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc)
+	Kernels_Init();
+	return TRUE;
+}
+#else
+static pthread_once_t GKernelsOnce = PTHREAD_ONCE_INIT;
+#endif
+
+void
+PokeQuery_Init(void)
 {
-	action->func(pokemon, misc, &action->context);
+#ifdef _WIN32
+	InitOnceExecuteOnce(&GKernelsOnce, PokeQuery_InitOnce, NULL, NULL);
+#else
+	pthread_once(&GKernelsOnce, Kernels_Init);
+#endif
 }
 
-static void
-Actions_Nickname(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+struct PokeQuery_Battery*
+PokeQuery_Battery_Open(const char* path, bool writable)
 {
-	UNUSED(misc);
+	PokeQuery_Init();
 
-	struct StringSpan name = CONTEXT(struct StringSpan);
-	String_Encode(name.data, name.size, pokemon->nickname, POKEMON_NICKNAME_SIZE);
+	struct PokeQuery_Battery* battery = (struct PokeQuery_Battery*)malloc(sizeof(struct PokeQuery_Battery));
+	if (battery == NULL)
+		return NULL;
+
+	if (!FileKey_Get(path, &battery->key) || !BatteryFile_Open(&battery->file, path, writable))
+	{
+		free(battery);
+		return NULL;
+	}
+
+	struct Section* sections[SECTION_COUNT];
+
+	if (!Query_LoadStorage(&battery->file, sections, SECTION_MASK_STORAGE))
+	{
+		BatteryFile_Close(&battery->file);
+		free(battery);
+		return NULL;
+	}
+
+	StorageSnapshot_Build(&battery->snapshot, sections, &battery->key);
+
+	RwLock_Init(&battery->lock);
+	battery->writable = writable;
+
+	Mutex_Init(&battery->mutex);
+	battery->spares = NULL;
+	return battery;
 }
 
-static void
-Actions_TrainerName(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+void
+PokeQuery_Battery_Close(struct PokeQuery_Battery* battery)
 {
-	UNUSED(misc);
+	while (battery->spares != NULL)
+	{
+		struct QueryWorkspace* workspace = battery->spares;
+		battery->spares = workspace->next;
+		QueryWorkspace_Destroy(workspace);
+	}
 
-	struct StringSpan name = CONTEXT(struct StringSpan);
-	String_Encode(name.data, name.size, pokemon->trainerName, POKEMON_OT_NAME_SIZE);
+	Mutex_Destroy(&battery->mutex);
+	RwLock_Destroy(&battery->lock);
+	BatteryFile_Close(&battery->file);
+	free(battery);
 }
 
-static void
-Actions_TrainerGender(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+bool
+PokeQuery_Battery_Select(struct PokeQuery_Battery* battery, const struct PokeQuery_Query* query, PokeQuery_FnRow* row, void* context)
 {
-	UNUSED(pokemon);
+	if (ProgramArguments_IsMutating(&query->arguments))
+		return false;
 
-	misc->origin.gender = CONTEXT(bool);
+	RwLock_LockShared(&battery->lock);
+	bool result = PokeQuery_Battery_Execute(battery, query, row, context, false);
+	RwLock_UnlockShared(&battery->lock);
+	return result;
 }
 
-static void
-Actions_MetLocation(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+bool
+PokeQuery_Battery_Update(struct PokeQuery_Battery* battery, const struct PokeQuery_Query* query, PokeQuery_FnRow* row, void* context)
 {
-	UNUSED(misc);
+	if (!battery->writable)
+		return false;
 
-	pokemon->data.misc.location = CONTEXT(uint8_t);
+	RwLock_Lock(&battery->lock);
+	bool result = PokeQuery_Battery_Execute(battery, query, row, context, true);
+	RwLock_Unlock(&battery->lock);
+	return result;
 }
 
-static void
-Actions_HeldItem(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+bool
+PokeQuery_Battery_Commit(struct PokeQuery_Battery* battery)
 {
-	UNUSED(misc);
+	RwLock_Lock(&battery->lock);
+	bool result = BatteryFile_Commit(&battery->file);
+	RwLock_Unlock(&battery->lock);
+	return result;
+}
 
-	pokemon->data.growth.item = CONTEXT(uint16_t);
+struct PokeQuery_Query*
+PokeQuery_Query_Create(void)
+{
+	struct PokeQuery_Query* query = (struct PokeQuery_Query*)malloc(sizeof(struct PokeQuery_Query));
+	if (query == NULL)
+		return NULL;
+
+	ProgramArguments_Init(&query->arguments);
+	ProgramArguments_Plan(&query->arguments);
+	query->stringCount = 0;
+	return query;
 }
 
-static void
-Actions_Ball(struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc, const void* context)
+void
+PokeQuery_Query_Destroy(struct PokeQuery_Query* query)
 {
-	UNUSED(pokemon);
+	for (size_t i = 0; i < query->stringCount; ++i)
+		free(query->strings[i]);
 
-	misc->origin.ball = CONTEXT(uint8_t);
+	ProgramArguments_Destroy(&query->arguments);
+	free(query);
 }
 
-struct ActionInfo
+// Adds an op term for the filter, which the caller has filled in, to the
+// root conjunction and plans the query again.
+static bool
+PokeQuery_Query_AddFilter(struct PokeQuery_Query* query, bool expect)
 {
-	const char* name;
-	FnAction* func;
-	FnParseContext* parseContext;
-};
+	struct ProgramArguments* arguments = &query->arguments;
 
-struct ActionInfo const GActions[] = {
-	{ "nickname", Actions_Nickname, ParseContext_StringSpan },
-	{ "trainer-name", Actions_TrainerName, ParseContext_StringSpan },
-	{ "trainer-gender", Actions_TrainerGender, ParseContext_Gender },
-	{ "met-location", Actions_MetLocation, ParseContext_uint8 },
-	{ "held-item", Actions_HeldItem, ParseContext_uint16 },
-	{ "ball", Actions_Ball, ParseContext_uint8 },
-};
+	size_t term = ProgramArguments_AddTerm(arguments, FILTER_NODE_OP);
+	if (term == FILTER_NODE_NONE)
+		return false;
 
-struct ProgramArguments
+	arguments->terms[term].filter = (uint8_t)arguments->filterCount++;
+	arguments->terms[term].expect = expect;
+	ProgramArguments_AppendTerm(arguments, 0, term);
+
+	ProgramArguments_Plan(arguments);
+	return true;
+}
+
+bool
+PokeQuery_Query_Where(struct PokeQuery_Query* query, enum PokeQuery_Filter filter, uint32_t value, bool expect)
 {
-	const char* file;
+	struct ProgramArguments* arguments = &query->arguments;
 
-	size_t filterCount;
-	struct Filter filters[32];
+	if ((size_t)filter >= ARRAY_SIZE(GFilters) || arguments->filterCount == ARRAY_SIZE(arguments->filters))
+		return false;
 
-	size_t actionCount;
-	struct Action actions[32];
-};
+	const struct FilterInfo* info = &GFilters[filter];
+	struct Filter* target = &arguments->filters[arguments->filterCount];
 
-typedef size_t FnParseCommand(struct ProgramArguments* arguments, size_t argc, const char** argv);
+	if (!Context_SetNumber(target->context, info->parseContext, value))
+		return false;
+	target->compile = info->compile;
 
-struct CommandInfo
-{
-	const char* name;
-	FnParseCommand* parse;
-};
+	return PokeQuery_Query_AddFilter(query, expect);
+}
 
-static size_t
-Commands_Where(struct ProgramArguments* arguments, size_t argc, const char** argv)
+bool
+PokeQuery_Query_WhereIn(struct PokeQuery_Query* query, enum PokeQuery_Filter filter, const uint16_t* keys, size_t count, bool expect)
 {
-	if (argc < 2)
-		return 0;
+	struct ProgramArguments* arguments = &query->arguments;
 
-	bool expect = true;
-	if (strcmp(argv[0], "not") == 0)
-	{
-		expect = false;
-		if (argc < 3)
-			return 0;
-		++argv;
-	}
+	if ((size_t)filter >= ARRAY_SIZE(GFilters) || arguments->filterCount == ARRAY_SIZE(arguments->filters))
+		return false;
 
-	const char* key = argv[0];
-	for (size_t i = 0, c = ARRAY_SIZE(GFilters); i < c; ++i)
-	{
-		const struct FilterInfo* info = &GFilters[i];
+	const struct FilterInfo* info = &GFilters[filter];
+	struct Filter* target = &arguments->filters[arguments->filterCount];
 
-		if (strcmp(info->name, key) == 0)
-		{
-			size_t index = arguments->filterCount;
-			if (index == ARRAY_SIZE(arguments->filters))
-				return 0;
-			struct Filter* filter = &arguments->filters[index];
-			++arguments->filterCount;
+	struct FilterSet* set = ProgramArguments_AddSet(arguments);
+	if (set == NULL)
+		return false;
 
-			const struct StringSpan val = StringSpan_FromCString(argv[1]);
-			if (!info->parseContext(&filter->context, val))
-				return 0;
-			filter->func = info->func;
-			filter->expect = expect;
-			return expect ? 2 : 3;
-		}
-	}
+	for (size_t i = 0; i < count; ++i)
+		FilterSet_Add(set, keys[i]);
 
-	return 0;
+	void* context = target->context;
+	CONTEXT_SET(struct FilterSetContext).keys = set;
+	CONTEXT_SET(struct FilterSetContext).compile = info->compile;
+	target->compile = info->compileSet != NULL ? info->compileSet : Filters_Set;
+
+	return PokeQuery_Query_AddFilter(query, expect);
 }
 
-static size_t
-Commands_Set(struct ProgramArguments* arguments, size_t argc, const char** argv)
+bool
+PokeQuery_Query_WhereName(struct PokeQuery_Query* query, enum PokeQuery_NameFilter filter, const char* name, bool prefix, bool expect)
 {
-	if (argc < 2)
-		return 0;
+	struct ProgramArguments* arguments = &query->arguments;
 
-	const char* key = argv[0];
-	for (size_t i = 0, c = ARRAY_SIZE(GActions); i < c; ++i)
-	{
-		const struct ActionInfo* info = &GActions[i];
+	if ((size_t)filter >= ARRAY_SIZE(GNameFilters))
+		return false;
 
-		if (strcmp(info->name, key) == 0)
-		{
-			size_t index = arguments->actionCount;
-			if (index == ARRAY_SIZE(arguments->actions))
-				return 0;
-			struct Action* action = &arguments->actions[index];
-			++arguments->actionCount;
+	size_t term = ProgramArguments_AddNameTerm(arguments, &GNameFilters[filter], StringSpan_FromCString(name), prefix);
+	if (term == FILTER_NODE_NONE)
+		return false;
 
-			const struct StringSpan val = StringSpan_FromCString(argv[1]);
-			if (!info->parseContext(&action->context, val))
-				return 0;
-			action->func = info->func;
-			return 2;
-		}
-	}
+	arguments->terms[term].expect = expect;
+	ProgramArguments_AppendTerm(arguments, 0, term);
 
-	return 0;
+	ProgramArguments_Plan(arguments);
+	return true;
 }
 
-static const struct CommandInfo GCommands[] = {
-	{ "where", Commands_Where },
-	{ "set", Commands_Set },
-};
-
-static bool
-ProgramArguments_Parse(struct ProgramArguments* arguments, size_t argc, const char** argv)
+bool
+PokeQuery_Query_Set(struct PokeQuery_Query* query, enum PokeQuery_Action action, uint32_t value)
 {
-	if (argc == 0)
+	struct ProgramArguments* arguments = &query->arguments;
+
+	if ((size_t)action >= ARRAY_SIZE(GActions) || arguments->actionCount == ARRAY_SIZE(arguments->actions))
 		return false;
 
-	arguments->file = argv[0];
-	arguments->filterCount = 0;
-	arguments->actionCount = 0;
+	const struct ActionInfo* info = &GActions[action];
+	struct Action* target = &arguments->actions[arguments->actionCount];
 
-	for (size_t i = 1; i < argc;)
-	{
-		const char* name = argv[i++];
+	if (!Context_SetNumber(target->context, info->parseContext, value))
+		return false;
+	target->func = info->func;
 
-		const struct CommandInfo* info = GCommands;
-		for (const struct CommandInfo* last = info + ARRAY_SIZE(GCommands);;)
-		{
-			if (strcmp(info->name, name) == 0)
-				break;
+	++arguments->actionCount;
+	return true;
+}
 
-			if (++info == last)
-				return false;
-		}
+bool
+PokeQuery_Query_SetString(struct PokeQuery_Query* query, enum PokeQuery_Action action, const char* value)
+{
+	struct ProgramArguments* arguments = &query->arguments;
 
-		size_t count = info->parse(arguments, argc - i, argv + i);
+	if ((size_t)action >= ARRAY_SIZE(GActions) || arguments->actionCount == ARRAY_SIZE(arguments->actions))
+		return false;
 
-		if (count == 0)
-			return false;
+	const struct ActionInfo* info = &GActions[action];
+	if (info->parseContext != ParseContext_StringSpan)
+		return false;
 
-		i += count;
-	}
+	size_t length = strlen(value);
+	char* copy = String_Duplicate(value, length);
+	if (copy == NULL)
+		return false;
+	query->strings[query->stringCount++] = copy;
 
+	struct Action* target = &arguments->actions[arguments->actionCount++];
+	info->parseContext(target->context, StringSpan_Create(copy, length));
+	target->func = info->func;
 	return true;
 }
 
-static bool
-ProgramArguments_Filter(const struct ProgramArguments* arguments, const struct Pokemon* pokemon, const struct Pokemon_Misc_Unpacked* misc, size_t index)
+uint32_t
+PokeQuery_Row_GetNumber(const struct PokeQuery_Row* row, enum PokeQuery_Field field)
 {
-	for (size_t i = 0, c = arguments->filterCount; i < c; ++i)
-		if (!Filter_Invoke(&arguments->filters[i], pokemon, misc, index))
-			return false;
-	return true;
+	if ((size_t)field >= ARRAY_SIZE(GFields) || GFields[field].type == FIELD_TYPE_STRING)
+		return 0;
+	return OutputRow_GetNumber(&row->row, &GFields[field]);
 }
 
-static void
-ProgramArguments_Mutate(const struct ProgramArguments* arguments, struct Pokemon* pokemon, struct Pokemon_Misc_Unpacked* misc)
+const char*
+PokeQuery_Row_GetString(const struct PokeQuery_Row* row, enum PokeQuery_Field field)
 {
-	for (size_t i = 0, c = arguments->actionCount; i < c; ++i)
-		Action_Invoke(&arguments->actions[i], pokemon, misc);
+	if ((size_t)field >= ARRAY_SIZE(GFields))
+		return "";
+	return OutputRow_GetString(&row->row, &GFields[field]);
 }
 
+// Building with POKEQUERY_LIBRARY defined leaves out main, for embedding
+// through the functions declared in PokeQuery.h. The PokeQuery.vcxproj
+// Library configurations build it as a static library.
+#ifndef POKEQUERY_LIBRARY
 int
 main(int argc, const char** argv)
 {
-	struct ProgramArguments args;
-	if (!ProgramArguments_Parse(&args, argc - 1, argv + 1))
-		return 1;
-
-	struct Battery battery;
-	if (!Battery_Load(&battery, args.file))
-		return 1;
-
-	struct Save* save;
-	if (!Battery_GetCurrentSave(&battery, &save))
-		return 1;
+	Kernels_Init();
 
-	struct Section* sections[SECTION_COUNT];
-	if (!Save_GetSections(save, sections))
-		return 1;
-
-	struct PokemonStorage storage;
-	if (!PokemonStorage_Load(&storage, sections))
-		return 1;
+	if (argc >= 3 && strcmp(argv[1], "serve") == 0)
+		return Server_Run(argv[2], argc - 3, argv + 3) ? 0 : 1;
 
-	bool mutate = args.actionCount > 0;
-	for (size_t i = 0; i < STORAGE_BOX_COUNT * STORAGE_BOX_SIZE; ++i)
+	struct ProgramArguments args;
+	if (!ProgramArguments_Parse(&args, argc - 1, argv + 1, true))
 	{
-		struct Pokemon* pokemon = &storage.pokemon[i];
-
-		if (!Pokemon_Exists(pokemon))
-			continue;
-
-		Pokemon_Decrypt(pokemon);
-		if (Pokemon_CalculateChecksum(pokemon) != pokemon->checksum)
-			return 1;
-		Pokemon_Unscramble(pokemon);
-
-		struct Pokemon_Misc_Unpacked misc;
-		Pokemon_Misc_Unpack(&pokemon->data.misc, &misc);
-
-		char nickname[32];
-		if (misc.values.egg && memcmp(pokemon->nickname, "\x60\x6F\x8B\xFF", 4) == 0)
-			strcpy(nickname, "@EGG");
-		else String_Decode(pokemon->nickname, POKEMON_NICKNAME_SIZE, nickname, sizeof(nickname));
-
-		char trainerName[32];
-		String_Decode(pokemon->trainerName, POKEMON_OT_NAME_SIZE, trainerName, sizeof(trainerName));
-
-		if (ProgramArguments_Filter(&args, pokemon, &misc, i))
-		{
-			size_t box = i / STORAGE_BOX_SIZE + 1;
-			size_t slot = i % STORAGE_BOX_SIZE + 1;
-
-			const struct PokemonInfo* info = &GPokemon[pokemon->data.growth.species];
-
-			printf("%02u/%02u: %03u %-" PP_STR(POKEMON_NICKNAME_SIZE) "s %-" PP_STR(POKEMON_NICKNAME_SIZE) "s from %05u %c %-" PP_STR(POKEMON_OT_NAME_SIZE) "s",
-				(unsigned)box, (unsigned)slot, info->index, info->name, nickname, pokemon->trainerPublic, misc.origin.gender ? 'F' : 'M', trainerName);
-
-			putchar('\n');
-
-			if (mutate)
-			{
-				ProgramArguments_Mutate(&args, pokemon, &misc);
-				Pokemon_Misc_Pack(&pokemon->data.misc, &misc);
-			}
-		}
-
-		Pokemon_Scramble(pokemon);
-		pokemon->checksum = Pokemon_CalculateChecksum(pokemon);
-		Pokemon_Encrypt(pokemon);
+		ProgramArguments_Destroy(&args);
+		return 2;
 	}
 
-	if (mutate)
-	{
-		if (!PokemonStorage_Save(&storage, sections))
-			return 1;
+	size_t rows;
+	bool limited = args.limit != 0;
+	bool result = Batch_Run(&args, &rows);
+	ProgramArguments_Destroy(&args);
 
-		if (!Battery_Save(&battery, args.file))
-			return 1;
-	}
+	// Like grep, limited queries exit with 1 if nothing matched and with 2
+	// if the query failed. Invalid arguments always exit with 2.
+	if (limited)
+		return result ? rows != 0 ? 0 : 1 : 2;
 
-	return 0;
+	return result ? 0 : 1;
 }
+#endif
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifndef POKEQUERY_API
+#	define POKEQUERY_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A battery file loaded for queries. Any number of threads may select from
+// the same battery at once; updates and commits wait for them and exclude
+// each other.
+struct PokeQuery_Battery;
+
+// Filters and actions, built without parsing. A query is not modified by
+// running it, so it can be shared between threads once built.
+struct PokeQuery_Query;
+
+// A Pokémon passed to a select callback, valid until the callback returns.
+struct PokeQuery_Row;
+
+enum PokeQuery_Filter
+{
+	POKEQUERY_FILTER_BOX,
+	POKEQUERY_FILTER_SLOT,
+	POKEQUERY_FILTER_POKEDEX,
+	POKEQUERY_FILTER_HELD_ITEM,
+	POKEQUERY_FILTER_TRAINER_ID,
+	POKEQUERY_FILTER_TRAINER_GENDER,
+
+	POKEQUERY_FILTER_COUNT
+};
+
+enum PokeQuery_NameFilter
+{
+	POKEQUERY_NAME_FILTER_NICKNAME,
+	POKEQUERY_NAME_FILTER_TRAINER_NAME,
+
+	POKEQUERY_NAME_FILTER_COUNT
+};
+
+enum PokeQuery_Action
+{
+	POKEQUERY_ACTION_NICKNAME,
+	POKEQUERY_ACTION_TRAINER_NAME,
+	POKEQUERY_ACTION_TRAINER_GENDER,
+	POKEQUERY_ACTION_MET_LOCATION,
+	POKEQUERY_ACTION_HELD_ITEM,
+	POKEQUERY_ACTION_BALL,
+
+	POKEQUERY_ACTION_COUNT
+};
+
+enum PokeQuery_Field
+{
+	POKEQUERY_FIELD_BOX,
+	POKEQUERY_FIELD_SLOT,
+	POKEQUERY_FIELD_PERSONALITY,
+	POKEQUERY_FIELD_TRAINER_ID,
+	POKEQUERY_FIELD_SECRET_ID,
+	POKEQUERY_FIELD_SPECIES,
+	POKEQUERY_FIELD_POKEDEX,
+	POKEQUERY_FIELD_NAME,
+	POKEQUERY_FIELD_NICKNAME,
+	POKEQUERY_FIELD_TRAINER_NAME,
+	POKEQUERY_FIELD_TRAINER_GENDER,
+	POKEQUERY_FIELD_HELD_ITEM,
+	POKEQUERY_FIELD_EXPERIENCE,
+	POKEQUERY_FIELD_FRIENDSHIP,
+	POKEQUERY_FIELD_MOVE1,
+	POKEQUERY_FIELD_MOVE2,
+	POKEQUERY_FIELD_MOVE3,
+	POKEQUERY_FIELD_MOVE4,
+	POKEQUERY_FIELD_MET_LOCATION,
+	POKEQUERY_FIELD_MET_LEVEL,
+	POKEQUERY_FIELD_GAME,
+	POKEQUERY_FIELD_BALL,
+	POKEQUERY_FIELD_IV_HP,
+	POKEQUERY_FIELD_IV_ATK,
+	POKEQUERY_FIELD_IV_DEF,
+	POKEQUERY_FIELD_IV_SPD,
+	POKEQUERY_FIELD_IV_SPATK,
+	POKEQUERY_FIELD_IV_SPDEF,
+
+	POKEQUERY_FIELD_COUNT
+};
+
+// Returns false to stop the select.
+typedef bool PokeQuery_FnRow(void* context, const struct PokeQuery_Row* row);
+
+// Selects the SIMD kernels. PokeQuery_Battery_Open calls it as well, and
+// calls after the first do nothing.
+POKEQUERY_API void
+PokeQuery_Init(void);
+
+// Returns NULL if the file cannot be opened or holds no valid save.
+POKEQUERY_API struct PokeQuery_Battery*
+PokeQuery_Battery_Open(const char* path, bool writable);
+
+// Changes that were not committed are discarded.
+POKEQUERY_API void
+PokeQuery_Battery_Close(struct PokeQuery_Battery* battery);
+
+// Calls row for each Pokémon matching the query, in storage order. The
+// query must not have actions.
+POKEQUERY_API bool
+PokeQuery_Battery_Select(struct PokeQuery_Battery* battery, const struct PokeQuery_Query* query, PokeQuery_FnRow* row, void* context);
+
+// Applies the actions of the query to each matching Pokémon in memory.
+// If row is not NULL, it is called with each one before it is changed,
+// and returning false stops the update before changing that one.
+POKEQUERY_API bool
+PokeQuery_Battery_Update(struct PokeQuery_Battery* battery, const struct PokeQuery_Query* query, PokeQuery_FnRow* row, void* context);
+
+// Writes the sections changed by updates back to the file.
+POKEQUERY_API bool
+PokeQuery_Battery_Commit(struct PokeQuery_Battery* battery);
+
+// A new query matches every Pokémon and has no actions.
+POKEQUERY_API struct PokeQuery_Query*
+PokeQuery_Query_Create(void);
+
+POKEQUERY_API void
+PokeQuery_Query_Destroy(struct PokeQuery_Query* query);
+
+// Adds a conjunct comparing the filter to value. Genders are 0 for male
+// and 1 for female.
+POKEQUERY_API bool
+PokeQuery_Query_Where(struct PokeQuery_Query* query, enum PokeQuery_Filter filter, uint32_t value, bool expect);
+
+// Adds a conjunct testing the filter against a list of keys.
+POKEQUERY_API bool
+PokeQuery_Query_WhereIn(struct PokeQuery_Query* query, enum PokeQuery_Filter filter, const uint16_t* keys, size_t count, bool expect);
+
+// Adds a conjunct matching a name, or only its start if prefix is set.
+POKEQUERY_API bool
+PokeQuery_Query_WhereName(struct PokeQuery_Query* query, enum PokeQuery_NameFilter filter, const char* name, bool prefix, bool expect);
+
+POKEQUERY_API bool
+PokeQuery_Query_Set(struct PokeQuery_Query* query, enum PokeQuery_Action action, uint32_t value);
+
+// For the name actions. The string is copied.
+POKEQUERY_API bool
+PokeQuery_Query_SetString(struct PokeQuery_Query* query, enum PokeQuery_Action action, const char* value);
+
+// Numeric fields of a row. String fields read as 0.
+POKEQUERY_API uint32_t
+PokeQuery_Row_GetNumber(const struct PokeQuery_Row* row, enum PokeQuery_Field field);
+
+// String fields of a row, decoded as for text output. Numeric fields
+// read as "".
+POKEQUERY_API const char*
+PokeQuery_Row_GetString(const struct PokeQuery_Row* row, enum PokeQuery_Field field);
+
+#ifdef __cplusplus
+}
+#endif